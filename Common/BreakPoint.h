@@ -10,14 +10,58 @@
 namespace SketchUp {
 namespace RubyDebugger {
 
+// Condition on the hit count of a breakpoint, checked before its Ruby
+// condition.
+enum class HitCondition {
+  kNone,
+  kEqual,          // == N
+  kGreaterOrEqual, // >= N
+  kMultiple        // % N
+};
+
 struct BreakPoint {
-  BreakPoint() : index(0), enabled(false), line(0) {}
+  BreakPoint()
+    : index(0), enabled(false), line(0), hit_count(0),
+      hit_condition(HitCondition::kNone), hit_value(0), snapshot(false),
+      latency_ms(0), condition_quarantined(false) {}
+
+  // Returns true if the current hit count satisfies the hit condition.
+  bool IsHitConditionMet() const {
+    switch (hit_condition) {
+      case HitCondition::kEqual:
+        return hit_count == hit_value;
+      case HitCondition::kGreaterOrEqual:
+        return hit_count >= hit_value;
+      case HitCondition::kMultiple:
+        return hit_value != 0 && hit_count % hit_value == 0;
+      default:
+        return true;
+    }
+  }
 
   size_t index;
   bool enabled;
   std::string file;
   size_t line;
   std::string condition;
+  size_t hit_count;
+  HitCondition hit_condition;
+  size_t hit_value;
+  // If not empty the breakpoint is a logpoint, which logs this message
+  // instead of suspending. It may interpolate Ruby expressions with #{}.
+  std::string log_message;
+  // If set the breakpoint captures a snapshot of the stack and locals
+  // instead of suspending.
+  bool snapshot;
+  // If not empty the breakpoint is a function breakpoint on the method
+  // "Klass#name" or "Module.name", and has no file and line.
+  std::string method;
+  // If not 0 the function breakpoint times each call of its method, and is
+  // only hit when the call returns after more than this many milliseconds.
+  size_t latency_ms;
+  // Set while the condition is not evaluated anymore because it raised or
+  // was too slow, until it is changed or reset.
+  bool condition_quarantined;
 };
 
 } // end namespace RubyDebugger
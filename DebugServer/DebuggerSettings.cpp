@@ -37,6 +37,12 @@ static void Save(const BreakPoint& bp, ptree& pt) {
   pt.put("index", bp.index);
   pt.put("enabled", bp.enabled);
   pt.put("condition", bp.condition);
+  pt.put("hit_condition", static_cast<int>(bp.hit_condition));
+  pt.put("hit_value", bp.hit_value);
+  pt.put("log_message", bp.log_message);
+  pt.put("snapshot", bp.snapshot);
+  pt.put("method", bp.method);
+  pt.put("latency_ms", bp.latency_ms);
 }
 
 static void Load(const ptree& pt, BreakPoint& bp) {
@@ -45,6 +51,12 @@ static void Load(const ptree& pt, BreakPoint& bp) {
   bp.index = pt.get<size_t>("index");
   bp.enabled = pt.get<bool>("enabled");
   bp.condition = pt.get<std::string>("condition");
+  bp.hit_condition = static_cast<HitCondition>(pt.get<int>("hit_condition", 0));
+  bp.hit_value = pt.get<size_t>("hit_value", 0);
+  bp.log_message = pt.get<std::string>("log_message", "");
+  bp.snapshot = pt.get<bool>("snapshot", false);
+  bp.method = pt.get<std::string>("method", "");
+  bp.latency_ms = pt.get<size_t>("latency_ms", 0);
 }
 
 void SaveBreakPoints(const BreakPointsMap& resolved_bps,
@@ -5,6 +5,7 @@
 #ifndef RDEBUGGER_DEBUGSERVER_IDEBUGSERVER_H_
 #define RDEBUGGER_DEBUGSERVER_IDEBUGSERVER_H_
 
+#include <functional>
 #include <vector>
 #include <string>
 
@@ -13,6 +14,7 @@ namespace RubyDebugger {
 
 // Forward declarations
 struct BreakPoint;
+enum class HitCondition;
 struct StackFrame;
 
 // Information about a local or global variable
@@ -26,6 +28,85 @@ struct Variable {
   size_t object_id;
 };
 
+// Information about a Ruby thread
+struct ThreadInfo {
+  ThreadInfo() : id(0), is_current(false) {}
+
+  size_t id;
+  std::string status;
+  bool is_current;
+};
+
+// A stack frame captured by a snapshot breakpoint.
+struct SnapshotFrame {
+  SnapshotFrame() : line(0) {}
+
+  std::string name;
+  std::string file;
+  int line;
+};
+
+// The stack and locals captured by a snapshot breakpoint. The values are
+// rendered when captured, nothing refers to Ruby objects.
+struct Snapshot {
+  Snapshot() : id(0), bp_index(0), line(0), thread_id(0) {}
+
+  size_t id;
+  size_t bp_index;
+  std::string file;
+  size_t line;
+  size_t thread_id;
+  // From the innermost frame outwards.
+  std::vector<SnapshotFrame> frames;
+  // The locals of the innermost frames, one vector per frame.
+  std::vector<std::vector<Variable>> locals;
+};
+
+// Bounds the cost of capturing snapshots and the memory they take.
+struct SnapshotLimits {
+  SnapshotLimits()
+    : max_frames(20),
+      max_local_frames(1),
+      max_variables(50),
+      max_string_length(200),
+      max_snapshots(100) {}
+
+  // Frames captured per snapshot.
+  size_t max_frames;
+  // Innermost frames whose locals are captured. More than one makes Ruby
+  // create the bindings of the whole stack on each snapshot.
+  size_t max_local_frames;
+  // Locals captured per frame.
+  size_t max_variables;
+  // Longer values are truncated.
+  size_t max_string_length;
+  // Snapshots kept, the oldest ones are dropped.
+  size_t max_snapshots;
+};
+
+// Suspends execution in a file when a line allocated more than max_objects
+// objects, counted from the previous line of the same frame to the next one.
+struct AllocationPoint {
+  AllocationPoint() : max_objects(0) {}
+
+  // Full path of the file, or the end of it like the file of a breakpoint.
+  std::string file;
+  size_t max_objects;
+};
+
+// Suspends execution when an instance variable of an object changes.
+struct WatchPoint {
+  WatchPoint() : index(0), object_id(0) {}
+
+  size_t index;
+  // Id of the object, as reported with its variables.
+  size_t object_id;
+  // Name of the instance variable, e.g. "@transformation".
+  std::string ivar;
+  // Class of the object.
+  std::string type;
+};
+
 // Interface to the debugger server.
 class IDebugServer {
 public:
@@ -33,6 +114,24 @@ public:
   // Stops the server
   virtual void Stop() = 0;
 
+  // Called by the UI when a debugger client attaches or detaches. Ruby code is
+  // only traced while a client is attached.
+  virtual void SetAttached(bool attached) = 0;
+
+  // Restricts tracing to the Ruby threads with the given ids (Thread#object_id).
+  // Only the main thread is traced when no ids are given. Other threads run
+  // without debugger hooks unless all_threads is true.
+  virtual void SetTracedThreads(const std::vector<size_t>& thread_ids,
+                                bool all_threads) = 0;
+
+  // Adds a path prefix whose files are stepped through (include) or run
+  // untraced while stepping (exclude). Takes effect while the path filter is
+  // enabled.
+  virtual void AddPathFilter(const std::string& path, bool include) = 0;
+
+  // Enables (or disables) the path filter.
+  virtual void EnablePathFilter(bool enable) = 0;
+
   // Adds the given breakpoint. Returns true on success.
   virtual bool AddBreakPoint(BreakPoint& bp, bool assume_resolved = false) = 0;
 
@@ -48,9 +147,84 @@ public:
   // Sets the condition for the breakpoint at the given index. Returns true on success.
   virtual bool ConditionBreakPoint(size_t index, const std::string& condition) = 0;
 
+  // Evaluates the quarantined condition of the breakpoint at the given index
+  // again. Returns false if there is no such breakpoint or its condition is
+  // not quarantined.
+  virtual bool ResetConditionBreakPoint(size_t index) = 0;
+
+  // Sets the hit condition for the breakpoint at the given index and resets
+  // its hit count. Returns true on success.
+  virtual bool HitConditionBreakPoint(size_t index, HitCondition hit_condition,
+                                      size_t hit_value) = 0;
+
+  // Turns the breakpoint at the given index into a logpoint logging the given
+  // message instead of suspending, or back into a breakpoint if the message is
+  // empty. Returns true on success.
+  virtual bool LogBreakPoint(size_t index, const std::string& message) = 0;
+
+  // Makes the breakpoint at the given index capture a snapshot of the stack
+  // and locals instead of suspending. Returns true on success.
+  virtual bool SnapshotBreakPoint(size_t index, bool snapshot) = 0;
+
+  // Makes the function breakpoint at the given index time each call of its
+  // method and only break when it takes longer than threshold_ms, or break on
+  // each call again if it is 0. Returns false if there is no such function
+  // breakpoint.
+  virtual bool LatencyBreakPoint(size_t index, size_t threshold_ms) = 0;
+
+  // Sets the limits applied to the snapshots captured from now on.
+  virtual void SetSnapshotLimits(const SnapshotLimits& limits) = 0;
+
+  virtual SnapshotLimits GetSnapshotLimits() const = 0;
+
+  // Returns the captured snapshots, oldest first.
+  virtual std::vector<Snapshot> GetSnapshots() const = 0;
+
+  // Gets the snapshot with the given id. Returns false if there is none.
+  virtual bool GetSnapshot(size_t id, Snapshot& snapshot) const = 0;
+
+  virtual void ClearSnapshots() = 0;
+
   // Returns all breakpoints.
   virtual std::vector<BreakPoint> GetBreakPoints() const = 0;
 
+  // Suspends execution when an exception of the given class, or of a
+  // subclass, is raised. The class does not need to be defined yet.
+  virtual void AddCatchPoint(const std::string& exception_class) = 0;
+
+  // Removes the catch point of the given class. Returns true on success.
+  virtual bool RemoveCatchPoint(const std::string& exception_class) = 0;
+
+  virtual void RemoveAllCatchPoints() = 0;
+
+  // Returns the classes of the catch points.
+  virtual std::vector<std::string> GetCatchPoints() const = 0;
+
+  // Sets an allocation point, or changes the limit of the existing one for
+  // the same file.
+  virtual void AddAllocationPoint(const AllocationPoint& point) = 0;
+
+  // Removes the allocation point of the given file. Returns true on success.
+  virtual bool RemoveAllocationPoint(const std::string& file) = 0;
+
+  virtual void RemoveAllAllocationPoints() = 0;
+
+  virtual std::vector<AllocationPoint> GetAllocationPoints() const = 0;
+
+  // Watches an instance variable of the object with the given id, which is
+  // only valid while stopped. The variable is compared at each line of the
+  // methods of the object's class and its ancestors up to Object, so changes
+  // made elsewhere are seen when one of them runs next. Returns the index of
+  // the watch point, or 0 on failure.
+  virtual size_t AddWatchPoint(size_t object_id, const std::string& ivar) = 0;
+
+  // Removes the watch point at the given index. Returns true on success.
+  virtual bool RemoveWatchPoint(size_t index) = 0;
+
+  virtual void RemoveAllWatchPoints() = 0;
+
+  virtual std::vector<WatchPoint> GetWatchPoints() const = 0;
+
   // Returns true if SketchUp has stopped and waiting for the debugger.
   // Returns false if it is running.
   virtual bool IsStopped() const = 0;
@@ -79,9 +253,47 @@ public:
   // Steps execution out of the current method.
   virtual void StepOut() = 0;
 
+  // Arms a temporary breakpoint at the next call of the given method by the
+  // suspended thread, e.g. "process", "face.area" or "Geom::Point3d#x". Must
+  // be called from the suspended thread and execution must be continued by
+  // the UI. Returns false if there is no such Ruby method.
+  virtual bool StepInto(const std::string& method) = 0;
+
+  // Steps the suspended thread until the given Ruby expression is true at a
+  // line, without suspending in between. Steps into calls if step_into is
+  // true. Must be called from the suspended thread and execution must be
+  // continued by the UI. Returns false if the expression does not compile.
+  virtual bool StepUntil(const std::string& expr, bool step_into) = 0;
+
+  // Sets a temporary breakpoint at the given line, which is removed when
+  // execution next suspends. Execution must be continued by the UI. Returns
+  // false if the file is not loaded.
+  virtual bool RunTo(const std::string& file, size_t line) = 0;
+
   // Interrupts execution at the first available opportunity.
   virtual void Pause() = 0;
 
+  // Runs the blocking func with the GVL released, so that other Ruby threads
+  // keep running while the calling thread waits. unblock is called from
+  // another thread to make func return early. Pending interrupts of the
+  // calling thread are serviced first, func is always called.
+  virtual void WaitWithoutGVL(const std::function<void(void)>& func,
+                              const std::function<void(void)>& unblock) = 0;
+
+  // Returns the Ruby threads as of the last suspension.
+  virtual std::vector<ThreadInfo> GetThreads() const = 0;
+
+  // Returns the id of the suspended thread, or 0 while running.
+  virtual size_t GetCurrentThreadId() const = 0;
+
+  // Suspends the thread with the given id at its next line. Returns false if
+  // there is no such thread.
+  virtual bool StopThread(size_t id) = 0;
+
+  // Cancels a pending stop of the thread with the given id. Returns false if
+  // there is no such thread.
+  virtual bool ResumeThread(size_t id) = 0;
+
   // Returns the code lines around the current line. Execution must have stopped.
   virtual std::vector<std::pair<size_t, std::string>>
       GetCodeLines(size_t beg_line, size_t end_line) const = 0;
@@ -0,0 +1,328 @@
+// SketchUp Ruby API Debugger. Copyright 2026 Trimble Inc.
+//
+
+#include <ruby.h>
+// Undo things Ruby do to the global namespace.
+#undef memcpy
+
+#include "./NativeCondition.h"
+
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+using namespace SketchUp::RubyDebugger;
+
+namespace {
+
+bool IsIdentifierStart(char ch) {
+  return ch == '_' || std::islower(static_cast<unsigned char>(ch));
+}
+
+bool IsIdentifierChar(char ch) {
+  return ch == '_' || std::isalnum(static_cast<unsigned char>(ch));
+}
+
+void SkipSpaces(const std::string& s, size_t& pos) {
+  while (pos < s.size() && (s[pos] == ' ' || s[pos] == '\t'))
+    ++pos;
+}
+
+// Reads a lower case identifier, method names may end with ? or !.
+bool ReadIdentifier(const std::string& s, size_t& pos, bool is_method,
+                    std::string& identifier) {
+  if (pos >= s.size() || !IsIdentifierStart(s[pos]))
+    return false;
+  size_t start = pos;
+  while (pos < s.size() && IsIdentifierChar(s[pos]))
+    ++pos;
+  if (is_method && pos < s.size() && (s[pos] == '?' || s[pos] == '!') &&
+      (pos + 1 == s.size() || s[pos + 1] != '='))
+    ++pos;
+  identifier = s.substr(start, pos - start);
+  return true;
+}
+
+bool IsKeyword(const std::string& identifier) {
+  static const char* keywords[] = {
+    "nil", "true", "false", "self", "not", "and", "or", "defined",
+    "__method__", "__FILE__", "__LINE__"
+  };
+  for (auto keyword : keywords) {
+    if (identifier == keyword)
+      return true;
+  }
+  return false;
+}
+
+struct EvaluationData {
+  const NativeCondition* condition;
+  VALUE binding;
+  VALUE self;
+};
+
+} // end anonymous namespace
+
+NativeCondition::NativeCondition()
+  : compiled_(false),
+    is_instance_variable_(false),
+    variable_id_(0),
+    operator_(kNoOperator),
+    literal_type_(kLiteralNil),
+    integer_(0),
+    float_(0.0),
+    symbol_id_(0) {}
+
+bool NativeCondition::Compile(const std::string& condition) {
+  compiled_ = false;
+  method_ids_.clear();
+  operator_ = kNoOperator;
+
+  const std::string& s = condition;
+  size_t pos = 0;
+  SkipSpaces(s, pos);
+
+  // The variable, optionally followed by method calls.
+  is_instance_variable_ = pos < s.size() && s[pos] == '@';
+  if (is_instance_variable_)
+    ++pos;
+  std::string identifier;
+  if (!ReadIdentifier(s, pos, false, identifier) ||
+      (!is_instance_variable_ && IsKeyword(identifier)))
+    return false;
+  variable_id_ = rb_intern((is_instance_variable_ ? "@" + identifier :
+                                                    identifier).c_str());
+  while (pos < s.size() && s[pos] == '.') {
+    ++pos;
+    if (!ReadIdentifier(s, pos, true, identifier))
+      return false;
+    method_ids_.push_back(rb_intern(identifier.c_str()));
+  }
+  SkipSpaces(s, pos);
+  if (pos == s.size()) {
+    compiled_ = true;
+    return true;
+  }
+
+  // The operator.
+  if (s.compare(pos, 2, "==") == 0) {
+    operator_ = kEqual;
+  } else if (s.compare(pos, 2, "!=") == 0) {
+    operator_ = kNotEqual;
+  } else if (s.compare(pos, 2, "<=") == 0) {
+    operator_ = kLessOrEqual;
+  } else if (s.compare(pos, 2, ">=") == 0) {
+    operator_ = kGreaterOrEqual;
+  } else if (s[pos] == '<') {
+    operator_ = kLess;
+  } else if (s[pos] == '>') {
+    operator_ = kGreater;
+  } else {
+    return false;
+  }
+  pos += (operator_ == kLess || operator_ == kGreater) ? 1 : 2;
+  // Rule out ===, <=>, << and the like.
+  if (pos < s.size() && std::strchr("=<>~", s[pos]))
+    return false;
+  SkipSpaces(s, pos);
+
+  // The literal.
+  if (pos == s.size())
+    return false;
+  if (s[pos] == '"' || s[pos] == '\'') {
+    char quote = s[pos++];
+    size_t end = s.find(quote, pos);
+    if (end == std::string::npos)
+      return false;
+    string_ = s.substr(pos, end - pos);
+    // Escapes and interpolation are left to Ruby.
+    if (string_.find('\\') != std::string::npos ||
+        (quote == '"' && string_.find('#') != std::string::npos))
+      return false;
+    literal_type_ = kLiteralString;
+    pos = end + 1;
+  } else if (s[pos] == ':') {
+    ++pos;
+    if (!ReadIdentifier(s, pos, true, identifier))
+      return false;
+    symbol_id_ = rb_intern(identifier.c_str());
+    literal_type_ = kLiteralSymbol;
+  } else if (s[pos] == '-' || std::isdigit(static_cast<unsigned char>(s[pos]))) {
+    std::string number;
+    if (s[pos] == '-')
+      number += s[pos++];
+    bool is_float = false;
+    while (pos < s.size()) {
+      char ch = s[pos];
+      if (std::isdigit(static_cast<unsigned char>(ch))) {
+        number += ch;
+      } else if (ch == '_' && !number.empty() &&
+                 std::isdigit(static_cast<unsigned char>(number.back()))) {
+        // Ruby allows underscores between digits.
+      } else if (ch == '.' && !is_float && pos + 1 < s.size() &&
+                 std::isdigit(static_cast<unsigned char>(s[pos + 1]))) {
+        number += ch;
+        is_float = true;
+      } else {
+        break;
+      }
+      ++pos;
+    }
+    if (number.empty() || number == "-")
+      return false;
+    // Leading zeros denote octal numbers in Ruby.
+    size_t digits = number[0] == '-' ? 1 : 0;
+    if (number[digits] == '0' && number.size() > digits + 1 &&
+        number[digits + 1] != '.')
+      return false;
+    char* end = nullptr;
+    if (is_float) {
+      float_ = std::strtod(number.c_str(), &end);
+      literal_type_ = kLiteralFloat;
+    } else {
+      errno = 0;
+      integer_ = std::strtoll(number.c_str(), &end, 10);
+      if (errno == ERANGE)
+        return false;
+      literal_type_ = kLiteralInteger;
+    }
+  } else {
+    if (!ReadIdentifier(s, pos, false, identifier))
+      return false;
+    if (identifier == "nil") {
+      literal_type_ = kLiteralNil;
+    } else if (identifier == "true") {
+      literal_type_ = kLiteralTrue;
+    } else if (identifier == "false") {
+      literal_type_ = kLiteralFalse;
+    } else {
+      return false;
+    }
+  }
+  SkipSpaces(s, pos);
+  if (pos != s.size())
+    return false;
+  compiled_ = true;
+  return true;
+}
+
+NativeCondition::Result NativeCondition::Evaluate(VALUE binding, VALUE self,
+                                                  bool truthy) const {
+  if (!compiled_)
+    return kUnsupported;
+  if (!is_instance_variable_) {
+    // A frame of a C method has no binding and no locals.
+    if (binding == Qnil)
+      return kUnsupported;
+    // A method or a variable defined by eval is left to Ruby.
+    static ID id_defined = rb_intern("local_variable_defined?");
+    if (!RTEST(rb_funcall(binding, id_defined, 1, ID2SYM(variable_id_))))
+      return kUnsupported;
+  }
+  EvaluationData data = { this, binding, self };
+  int error = 0;
+  VALUE result = rb_protect(EvaluateProtected,
+                            reinterpret_cast<VALUE>(&data), &error);
+  if (error != 0) {
+    rb_set_errinfo(Qnil);
+    return kError;
+  }
+  if (truthy)
+    return RTEST(result) ? kTrue : kFalse;
+  return result == Qtrue ? kTrue : kFalse;
+}
+
+VALUE NativeCondition::EvaluateProtected(VALUE data) {
+  auto evaluation = reinterpret_cast<const EvaluationData*>(data);
+  const NativeCondition* condition = evaluation->condition;
+  VALUE value = condition->GetValue(evaluation->binding, evaluation->self);
+  if (condition->operator_ == kNoOperator)
+    return value;
+  return condition->Compare(value) ? Qtrue : Qfalse;
+}
+
+VALUE NativeCondition::GetValue(VALUE binding, VALUE self) const {
+  VALUE value;
+  if (is_instance_variable_) {
+    value = rb_ivar_get(self, variable_id_);
+  } else {
+    static ID id_local_variable_get = rb_intern("local_variable_get");
+    value = rb_funcall(binding, id_local_variable_get, 1,
+                       ID2SYM(variable_id_));
+  }
+  for (ID method_id : method_ids_) {
+    value = rb_funcall(value, method_id, 0);
+  }
+  return value;
+}
+
+bool NativeCondition::Compare(VALUE value) const {
+  // Numbers, strings and singletons are compared without calling Ruby.
+  if ((literal_type_ == kLiteralInteger || literal_type_ == kLiteralFloat) &&
+      (FIXNUM_P(value) || RB_FLOAT_TYPE_P(value))) {
+    int comparison;
+    if (literal_type_ == kLiteralInteger && FIXNUM_P(value)) {
+      long long number = FIX2LONG(value);
+      comparison = number < integer_ ? -1 : (number > integer_ ? 1 : 0);
+    } else {
+      double number = FIXNUM_P(value) ? static_cast<double>(FIX2LONG(value)) :
+                                        RFLOAT_VALUE(value);
+      double literal = literal_type_ == kLiteralFloat ?
+          float_ : static_cast<double>(integer_);
+      if (number != number) // NaN compares false with anything.
+        return operator_ == kNotEqual;
+      comparison = number < literal ? -1 : (number > literal ? 1 : 0);
+    }
+    switch (operator_) {
+      case kEqual: return comparison == 0;
+      case kNotEqual: return comparison != 0;
+      case kLess: return comparison < 0;
+      case kLessOrEqual: return comparison <= 0;
+      case kGreater: return comparison > 0;
+      case kGreaterOrEqual: return comparison >= 0;
+      default: return false;
+    }
+  }
+  if (operator_ == kEqual || operator_ == kNotEqual) {
+    bool is_equal;
+    bool compared = true;
+    switch (literal_type_) {
+      case kLiteralNil: is_equal = NIL_P(value); break;
+      case kLiteralTrue: is_equal = value == Qtrue; break;
+      case kLiteralFalse: is_equal = value == Qfalse; break;
+      case kLiteralSymbol: is_equal = value == ID2SYM(symbol_id_); break;
+      case kLiteralString:
+        compared = RB_TYPE_P(value, T_STRING) &&
+                   rb_obj_class(value) == rb_cString;
+        is_equal = compared &&
+            static_cast<size_t>(RSTRING_LEN(value)) == string_.size() &&
+            std::memcmp(RSTRING_PTR(value), string_.data(),
+                        string_.size()) == 0;
+        break;
+      default: compared = false; is_equal = false; break;
+    }
+    // Objects with their own == are asked below.
+    if (compared &&
+        (literal_type_ == kLiteralString || SPECIAL_CONST_P(value)))
+      return operator_ == kEqual ? is_equal : !is_equal;
+  }
+  static ID ids[] = {
+    0, rb_intern("=="), rb_intern("!="), rb_intern("<"), rb_intern("<="),
+    rb_intern(">"), rb_intern(">=")
+  };
+  return RTEST(rb_funcall(value, ids[operator_], 1, GetLiteral()));
+}
+
+VALUE NativeCondition::GetLiteral() const {
+  switch (literal_type_) {
+    case kLiteralTrue: return Qtrue;
+    case kLiteralFalse: return Qfalse;
+    case kLiteralInteger: return LL2NUM(integer_);
+    case kLiteralFloat: return DBL2NUM(float_);
+    case kLiteralString: return rb_utf8_str_new(string_.data(),
+                                                string_.size());
+    case kLiteralSymbol: return ID2SYM(symbol_id_);
+    default: return Qnil;
+  }
+}
@@ -0,0 +1,88 @@
+// SketchUp Ruby API Debugger. Copyright 2026 Trimble Inc.
+//
+#ifndef RDEBUGGER_DEBUGSERVER_NATIVECONDITION_H_
+#define RDEBUGGER_DEBUGSERVER_NATIVECONDITION_H_
+
+#include <string>
+#include <vector>
+
+#pragma warning( push )
+#pragma warning( disable : 4117 ) // warning C4117: macro name '_INTEGRAL_MAX_BITS' is reserved, '#define' ignored
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wsign-conversion"
+#pragma clang diagnostic ignored "-Wdeprecated-register"
+#include <ruby/ruby.h>
+#pragma clang diagnostic pop
+#pragma warning( pop )
+
+namespace SketchUp {
+namespace RubyDebugger {
+
+// A breakpoint condition which is simple enough to be evaluated without
+// Ruby's parser: a local or instance variable, followed by any number of
+// calls of methods without arguments, optionally compared with a literal.
+// For instance `i == 4711`, `face.area > 10.0` or `name.nil?`.
+class NativeCondition {
+public:
+  enum Result { kFalse, kTrue, kError, kUnsupported };
+
+  NativeCondition();
+
+  // Parses the condition. Returns false if it is not simple enough, it then
+  // has to be evaluated by Ruby.
+  bool Compile(const std::string& condition);
+
+  bool IsCompiled() const { return compiled_; }
+
+  // Evaluates the condition in the given binding, which is nil for a C method.
+  // Returns kError if it raised and kUnsupported if it cannot be evaluated
+  // natively there, e.g. if the variable is not a local variable but a method.
+  // Only true satisfies a condition without comparison, unless truthy is set,
+  // then any value but nil and false does like in Ruby's if.
+  Result Evaluate(VALUE binding, VALUE self, bool truthy = false) const;
+
+private:
+  enum Operator {
+    kNoOperator,
+    kEqual,
+    kNotEqual,
+    kLess,
+    kLessOrEqual,
+    kGreater,
+    kGreaterOrEqual
+  };
+
+  enum LiteralType {
+    kLiteralNil,
+    kLiteralTrue,
+    kLiteralFalse,
+    kLiteralInteger,
+    kLiteralFloat,
+    kLiteralString,
+    kLiteralSymbol
+  };
+
+  static VALUE EvaluateProtected(VALUE data);
+
+  VALUE GetValue(VALUE binding, VALUE self) const;
+
+  bool Compare(VALUE value) const;
+
+  VALUE GetLiteral() const;
+
+  bool compiled_;
+  bool is_instance_variable_;
+  ID variable_id_;
+  std::vector<ID> method_ids_;
+  Operator operator_;
+  LiteralType literal_type_;
+  long long integer_;
+  double float_;
+  std::string string_;
+  ID symbol_id_;
+};
+
+} // end namespace RubyDebugger
+} // end namespace SketchUp
+
+#endif // RDEBUGGER_DEBUGSERVER_NATIVECONDITION_H_
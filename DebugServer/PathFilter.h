@@ -0,0 +1,95 @@
+// SketchUp Ruby API Debugger. Copyright 2026 Trimble Inc.
+//
+#ifndef RDEBUGGER_DEBUGSERVER_PATHFILTER_H_
+#define RDEBUGGER_DEBUGSERVER_PATHFILTER_H_
+
+#include <cctype>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace SketchUp {
+namespace RubyDebugger {
+
+// Include and exclude rules for script paths, compiled into a prefix trie.
+// Paths are compared case-insensitively and with either kind of slash. The
+// longest matching prefix decides, a prefix only matches whole directories.
+class PathFilter {
+public:
+  enum Rule { kNone, kInclude, kExclude };
+
+  PathFilter() : has_includes_(false) { nodes_.resize(1); }
+
+  void Add(const std::string& path, Rule rule) {
+    size_t node = 0;
+    for (char ch : path) {
+      ch = Normalize(ch);
+      auto it = nodes_[node].children.find(ch);
+      if (it == nodes_[node].children.end()) {
+        nodes_.push_back(Node());
+        it = nodes_[node].children.insert(
+            std::make_pair(ch, nodes_.size() - 1)).first;
+      }
+      node = it->second;
+    }
+    nodes_[node].rule = rule;
+    if (rule == kInclude)
+      has_includes_ = true;
+  }
+
+  void Clear() {
+    nodes_.clear();
+    nodes_.resize(1);
+    has_includes_ = false;
+  }
+
+  bool empty() const { return nodes_.size() == 1; }
+
+  // Returns true if the code of the given file is not stepped through. Files
+  // matching no rule are excluded only if there are include rules.
+  bool IsExcluded(const std::string& path) const {
+    if (empty())
+      return false;
+
+    Rule match = kNone;
+    size_t node = 0;
+    for (size_t i = 0; ; ++i) {
+      const Node& n = nodes_[node];
+      if (n.rule != kNone &&
+          (i == path.size() || Normalize(path[i]) == '/' ||
+           (i > 0 && Normalize(path[i - 1]) == '/'))) {
+        match = n.rule;
+      }
+      if (i == path.size())
+        break;
+      auto it = n.children.find(Normalize(path[i]));
+      if (it == n.children.end())
+        break;
+      node = it->second;
+    }
+    if (match == kNone)
+      return has_includes_;
+    return match == kExclude;
+  }
+
+private:
+  struct Node {
+    Node() : rule(kNone) {}
+
+    std::map<char, size_t> children;
+    Rule rule;
+  };
+
+  static char Normalize(char ch) {
+    return ch == '\\' ? '/' : static_cast<char>(
+        std::tolower(static_cast<unsigned char>(ch)));
+  }
+
+  std::vector<Node> nodes_;
+  bool has_includes_;
+};
+
+} // end namespace RubyDebugger
+} // end namespace SketchUp
+
+#endif // RDEBUGGER_DEBUGSERVER_PATHFILTER_H_
@@ -0,0 +1,65 @@
+// SketchUp Ruby API Debugger. Copyright 2026 Trimble Inc.
+//
+#ifndef RDEBUGGER_DEBUGSERVER_RINGBUFFER_H_
+#define RDEBUGGER_DEBUGSERVER_RINGBUFFER_H_
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+namespace SketchUp {
+namespace RubyDebugger {
+
+// Bounded lock-free queue for one producer and one consumer thread. Neither
+// side ever blocks: when the buffer is full the pushed element is dropped and
+// counted instead.
+template <typename T, size_t N>
+class RingBuffer {
+  static_assert(N != 0 && (N & (N - 1)) == 0,
+                "The capacity must be a power of two.");
+
+public:
+  RingBuffer() : head_(0), tail_(0), dropped_(0) {}
+
+  // Called by the producer. Returns false if the buffer was full.
+  bool Push(T&& value) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) == N) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    slots_[head & (N - 1)] = std::move(value);
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Called by the consumer. Passes each buffered element to func and returns
+  // their number.
+  template <typename Func>
+  size_t Drain(Func func) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    size_t head = head_.load(std::memory_order_acquire);
+    for (size_t i = tail; i != head; ++i) {
+      func(std::move(slots_[i & (N - 1)]));
+    }
+    tail_.store(head, std::memory_order_release);
+    return head - tail;
+  }
+
+  // Returns the number of elements dropped since the last call.
+  size_t TakeDropped() {
+    return dropped_.exchange(0, std::memory_order_relaxed);
+  }
+
+private:
+  T slots_[N];
+  // Kept on separate cache lines, written by the producer and the consumer.
+  alignas(64) std::atomic<size_t> head_;
+  alignas(64) std::atomic<size_t> tail_;
+  std::atomic<size_t> dropped_;
+};
+
+} // end namespace RubyDebugger
+} // end namespace SketchUp
+
+#endif // RDEBUGGER_DEBUGSERVER_RINGBUFFER_H_
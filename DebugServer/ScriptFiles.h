@@ -0,0 +1,82 @@
+// SketchUp Ruby API Debugger. Copyright 2026 Trimble Inc.
+//
+#ifndef RDEBUGGER_DEBUGSERVER_SCRIPTFILES_H_
+#define RDEBUGGER_DEBUGSERVER_SCRIPTFILES_H_
+
+#include "./DebuggerSettings.h"
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace SketchUp {
+namespace RubyDebugger {
+
+// A script file seen by the debugger.
+struct ScriptFile {
+  ScriptFile(size_t id, const std::string& path)
+    : id(id), path(path), excluded(false) {}
+
+  // Returns true if there is a breakpoint at the given line.
+  bool HasBreakPoint(size_t line) const {
+    size_t word = line / 64;
+    return word < breakpoint_lines.size() &&
+           (breakpoint_lines[word] & (uint64_t(1) << (line % 64))) != 0;
+  }
+
+  void SetBreakPoint(size_t line) {
+    size_t word = line / 64;
+    if (word >= breakpoint_lines.size())
+      breakpoint_lines.resize(word + 1, 0);
+    breakpoint_lines[word] |= uint64_t(1) << (line % 64);
+  }
+
+  size_t id;
+  std::string path;
+  // One bit per line, set for the lines which have a breakpoint.
+  std::vector<uint64_t> breakpoint_lines;
+  // Set if the path filter excludes the file from stepping.
+  bool excluded;
+};
+
+// Interns script files by path. The returned references stay valid for the
+// lifetime of the container.
+class ScriptFiles {
+public:
+  ScriptFile& Intern(const std::string& path) {
+    auto it = files_.find(path);
+    if (it == files_.end()) {
+      it = files_.insert(std::make_pair(path,
+                                        ScriptFile(by_id_.size(), path))).first;
+      by_id_.push_back(&it->second);
+    }
+    return it->second;
+  }
+
+  ScriptFile* Find(const std::string& path) {
+    auto it = files_.find(path);
+    return it != files_.end() ? &it->second : nullptr;
+  }
+
+  ScriptFile* Get(size_t id) {
+    return id < by_id_.size() ? by_id_[id] : nullptr;
+  }
+
+  size_t size() const { return by_id_.size(); }
+
+  void ClearBreakPoints() {
+    for (auto file : by_id_) {
+      file->breakpoint_lines.clear();
+    }
+  }
+
+private:
+  std::map<std::string, ScriptFile, CaseInsensitiveStringSort> files_;
+  std::vector<ScriptFile*> by_id_;
+};
+
+} // end namespace RubyDebugger
+} // end namespace SketchUp
+
+#endif // RDEBUGGER_DEBUGSERVER_SCRIPTFILES_H_
@@ -10,6 +10,7 @@
 #include <ruby.h>
 #include <ruby/debug.h>
 #include <ruby/encoding.h>
+#include <ruby/thread.h>
 // Undo things Ruby do to the global namespace.
 #undef memcpy
 
@@ -17,6 +18,10 @@
 #include "./DebuggerSettings.h"
 #include "./FindSubstringCaseInsensitive.h"
 #include "./Log.h"
+#include "./NativeCondition.h"
+#include "./PathFilter.h"
+#include "./ScriptFiles.h"
+#include "./ThreadStates.h"
 
 #include <Common/BreakPoint.h>
 #include <Common/StackFrame.h>
@@ -26,12 +31,21 @@
 #include <boost/lexical_cast.hpp>
 #pragma clang diagnostic pop
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <cctype>
+#include <cstring>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <string>
 #include <iostream>
+#include <limits>
 #include <map>
 #include <mutex>
 #include <regex>
+#include <set>
 #include <thread>
 
 using namespace SketchUp::RubyDebugger;
@@ -148,6 +162,246 @@ VALUE ProtectFuncall(VALUE obj, ID func, int argc, ...) {
   return result;
 }
 
+// Wraps the call to TracePoint#enable with keyword arguments so that it can be
+// run inside rb_protect.
+VALUE WrapEnableForTarget(VALUE data) {
+  VALUE tp = rb_ary_entry(data, 0);
+  VALUE opts = rb_ary_entry(data, 1);
+  static ID enable_method_id = rb_intern("enable");
+  return rb_funcallv_kw(tp, enable_method_id, 1, &opts, RB_PASS_KEYWORDS);
+}
+
+// Enables the tracepoint only for the given instruction sequence (and the
+// ones nested in it) and, unless line is 0, only for the given line. Returns
+// false if the target has no code at that line.
+bool EnableTracePointForTarget(VALUE tp, VALUE target, size_t line) {
+  static VALUE target_sym = ID2SYM(rb_intern("target"));
+  static VALUE target_line_sym = ID2SYM(rb_intern("target_line"));
+  VALUE opts = rb_hash_new();
+  rb_hash_aset(opts, target_sym, target);
+  if (line != 0)
+    rb_hash_aset(opts, target_line_sym, SIZET2NUM(line));
+
+  VALUE data = rb_ary_new_from_args(2, tp, opts);
+  int error = 0;
+  rb_protect(WrapEnableForTarget, data, &error);
+  if (error) {
+    rb_set_errinfo(Qnil);
+    return false;
+  }
+  return true;
+}
+
+// Collects the children of an instruction sequence which start at a line,
+// and theirs. The data is an array of the collected children and the line.
+VALUE CollectIseqsAtLine(VALUE child, VALUE data, int, const VALUE*,
+                         VALUE) {
+  static ID first_lineno_id = rb_intern("first_lineno");
+  static ID each_child_id = rb_intern("each_child");
+  int line = FIX2INT(RARRAY_AREF(data, 1));
+  int first_line = NUM2INT(rb_funcall(child, first_lineno_id, 0));
+  if (first_line == line)
+    rb_ary_push(RARRAY_AREF(data, 0), child);
+  // Code which starts after the line does not contain it.
+  if (first_line <= line)
+    rb_block_call(child, each_child_id, 0, nullptr, CollectIseqsAtLine, data);
+  return Qnil;
+}
+
+VALUE WrapCollectIseqsAtLine(VALUE data) {
+  static ID each_child_id = rb_intern("each_child");
+  rb_block_call(RARRAY_AREF(data, 2), each_child_id, 0, nullptr,
+                CollectIseqsAtLine, data);
+  return RARRAY_AREF(data, 0);
+}
+
+// Returns the instruction sequences of the methods, blocks and classes which
+// start at a line of the given instruction sequence.
+VALUE GetIseqsAtLine(VALUE iseq, size_t line) {
+  VALUE data = rb_ary_new_from_args(3, rb_ary_new(), SIZET2NUM(line), iseq);
+  int error = 0;
+  VALUE iseqs = rb_protect(WrapCollectIseqsAtLine, data, &error);
+  if (error) {
+    rb_set_errinfo(Qnil);
+    return rb_ary_new();
+  }
+  return iseqs;
+}
+
+VALUE WrapResolveMethod(VALUE data) {
+  VALUE owner = rb_path_to_class(rb_ary_entry(data, 0));
+  static ID instance_method_id = rb_intern("instance_method");
+  static ID method_id = rb_intern("method");
+  ID func = RTEST(rb_ary_entry(data, 2)) ? instance_method_id : method_id;
+  return rb_funcall(owner, func, 1, rb_ary_entry(data, 1));
+}
+
+// Returns the UnboundMethod named "Klass#name" or the Method named
+// "Module.name", or nil if it is not defined (yet). Only constants are looked
+// up, nothing is evaluated.
+VALUE ResolveMethod(const std::string& method) {
+  size_t hash = method.rfind('#');
+  size_t sep = hash != std::string::npos ? hash : method.rfind('.');
+  if (sep == std::string::npos || sep == 0 || sep + 1 == method.size())
+    return Qnil;
+  VALUE data = rb_ary_new_from_args(
+      3, rb_str_new(method.data(), static_cast<long>(sep)),
+      ID2SYM(rb_intern(method.c_str() + sep + 1)),
+      hash != std::string::npos ? Qtrue : Qfalse);
+  int error = 0;
+  VALUE result = rb_protect(WrapResolveMethod, data, &error);
+  if (error) {
+    rb_set_errinfo(Qnil);
+    return Qnil;
+  }
+  return result;
+}
+
+// Calls a compiled expression. The data is an array of the self and binding
+// of the frame, the proc and the names of the locals it takes. The proc is
+// the source of the expression if it is evaluated in the frame.
+VALUE CallCompiledProc(VALUE data) {
+  static ID local_variable_get_id = rb_intern("local_variable_get");
+  static ID instance_exec_id = rb_intern("instance_exec");
+  static ID eval_id = rb_intern("eval");
+  static ID instance_eval_id = rb_intern("instance_eval");
+  VALUE self = RARRAY_AREF(data, 0);
+  VALUE binding = RARRAY_AREF(data, 1);
+  VALUE proc = RARRAY_AREF(data, 2);
+  if (RB_TYPE_P(proc, T_STRING)) {
+    // The c_call event of a C method has no binding.
+    return binding != Qnil ? rb_funcall(binding, eval_id, 1, proc) :
+                             rb_funcall(self, instance_eval_id, 1, proc);
+  }
+  long argc = RARRAY_LEN(data) - 3;
+  VALUE args = rb_ary_new_capa(argc);
+  for (long i = 0; i < argc; ++i) {
+    rb_ary_push(args, rb_funcall(binding, local_variable_get_id, 1,
+                                 RARRAY_AREF(data, i + 3)));
+  }
+  return rb_funcall_with_block(self, instance_exec_id, static_cast<int>(argc),
+                               RARRAY_CONST_PTR(args), proc);
+}
+
+// Returns the names a Ruby expression may refer to as local variables.
+std::set<std::string> GetIdentifiers(const std::string& expr) {
+  std::set<std::string> identifiers;
+  for (size_t i = 0; i < expr.size(); ) {
+    char ch = expr[i];
+    if (ch == '_' || std::isalpha(static_cast<unsigned char>(ch))) {
+      size_t start = i;
+      while (i < expr.size() && (expr[i] == '_' ||
+             std::isalnum(static_cast<unsigned char>(expr[i]))))
+        ++i;
+      // Not a method call, instance, global or symbol.
+      if (start == 0 || !std::strchr(".@$:", expr[start - 1]))
+        identifiers.insert(expr.substr(start, i - start));
+    } else {
+      ++i;
+    }
+  }
+  return identifiers;
+}
+
+bool ScanCode(const std::string& expr, size_t& i, bool interpolated);
+
+// Scans a string literal from after its opening delimiter up to the closing
+// one, checking the code interpolated in it.
+bool ScanString(const std::string& expr, size_t& i, char open, char close) {
+  int depth = 0;
+  while (i < expr.size()) {
+    char ch = expr[i];
+    if (ch == '\\') {
+      i += 2;
+    } else if (ch == '#' && i + 1 < expr.size() && expr[i + 1] == '{') {
+      i += 2;
+      if (ScanCode(expr, i, true))
+        return true;
+    } else if (ch == close && depth == 0) {
+      ++i;
+      return false;
+    } else {
+      if (ch == open)
+        ++depth;
+      else if (ch == close)
+        --depth;
+      ++i;
+    }
+  }
+  return false;
+}
+
+// Scans code up to its end, or up to the brace closing an interpolation,
+// for what only resolves in the scope of the frame.
+bool ScanCode(const std::string& expr, size_t& i, bool interpolated) {
+  int depth = 0;
+  while (i < expr.size()) {
+    char ch = expr[i];
+    if (ch == '\'') {
+      for (++i; i < expr.size() && expr[i] != '\''; ++i) {
+        if (expr[i] == '\\')
+          ++i;
+      }
+      ++i;
+    } else if (ch == '"') {
+      ++i;
+      if (ScanString(expr, i, 0, '"'))
+        return true;
+    } else if (expr.compare(i, 3, "%Q{") == 0) {
+      i += 3;
+      if (ScanString(expr, i, '{', '}'))
+        return true;
+    } else if (ch == '{') {
+      ++depth;
+      ++i;
+    } else if (ch == '}') {
+      ++i;
+      if (interpolated && depth == 0)
+        return false;
+      --depth;
+    } else if (ch == '_' || std::isalpha(static_cast<unsigned char>(ch))) {
+      size_t start = i;
+      while (i < expr.size() && (expr[i] == '_' ||
+             std::isalnum(static_cast<unsigned char>(expr[i]))))
+        ++i;
+      // Not a method call, instance, global or symbol.
+      if (start != 0 && std::strchr(".@$:", expr[start - 1]))
+        continue;
+      std::string word = expr.substr(start, i - start);
+      if (std::isupper(static_cast<unsigned char>(word[0])) ||
+          word == "super" || word == "yield" || word == "block_given" ||
+          word == "__method__" || word == "binding")
+        return true;
+    } else {
+      ++i;
+    }
+  }
+  return false;
+}
+
+// Returns true if an expression refers to a constant, which is looked up in
+// the lexical scope of the code, or to the method or block of the frame.
+bool NeedsFrameScope(const std::string& expr) {
+  size_t i = 0;
+  return ScanCode(expr, i, false);
+}
+
+// Ruby-level calls and returns are only traced to keep track of the frame
+// depth while a step is pending. C calls are never traced.
+const rb_event_flag_t kStepEvents = RUBY_EVENT_LINE | RUBY_EVENT_CALL |
+    RUBY_EVENT_B_CALL | RUBY_EVENT_CLASS | RUBY_EVENT_RETURN |
+    RUBY_EVENT_B_RETURN | RUBY_EVENT_END;
+
+// Allocation points sample the allocation counter at each line, and keep
+// track of the frames to compare each line with the previous one of the same
+// frame.
+const rb_event_flag_t kAllocationFrameBeginEvents = RUBY_EVENT_CALL |
+    RUBY_EVENT_B_CALL | RUBY_EVENT_CLASS;
+const rb_event_flag_t kAllocationFrameEndEvents = RUBY_EVENT_RETURN |
+    RUBY_EVENT_B_RETURN | RUBY_EVENT_END;
+const rb_event_flag_t kAllocationEvents = RUBY_EVENT_LINE |
+    kAllocationFrameBeginEvents | kAllocationFrameEndEvents;
+
 VALUE EvaluateRubyExpressionAsValue(const std::string& expr, VALUE binding) {
   VALUE str_to_eval = GetRubyInterface(expr.c_str());
   static ID eval_method_id = rb_intern("eval");
@@ -166,11 +420,92 @@ Variable EvaluateRubyExpression(const std::string& expr, VALUE binding) {
   return var;
 }
 
+// Evaluates code at the top level of an instruction sequence of its own,
+// which has no locals and does not reference any frame.
+VALUE EvaluateIsolated(const std::string& source) {
+  static ID compile_id = rb_intern("compile");
+  static ID eval_id = rb_intern("eval");
+  VALUE iseq_class = rb_path2class("RubyVM::InstructionSequence");
+  VALUE iseq = ProtectFuncall(iseq_class, compile_id, 1,
+                              GetRubyInterface(source.c_str()));
+  if (!RTEST(rb_obj_is_kind_of(iseq, iseq_class)))
+    return Qnil;
+  return ProtectFuncall(iseq, eval_id, 0);
+}
+
+// Compiles an expression once, instead of evaluating its source each time.
+// The proc takes the locals of the frame the expression refers to as
+// arguments and is called with the self of each frame. It is compiled in a
+// scope of its own, so that it does not keep the frame of the given binding
+// alive. Assigning a local in the expression only changes the argument, not
+// the variable of the frame. An expression which refers to a constant,
+// super, yield, block_given?, __method__ or binding needs the scope of the
+// frame, its source is returned instead and evaluated in the binding of each
+// frame. Returns nil if it does not compile.
+VALUE CompileExpression(const std::string& expr, VALUE binding,
+                        std::vector<ID>& locals) {
+  static ID local_variables_id = rb_intern("local_variables");
+  static ID compile_id = rb_intern("compile");
+  locals.clear();
+  if (NeedsFrameScope(expr)) {
+    VALUE source = GetRubyInterface(expr.c_str());
+    VALUE iseq_class = rb_path2class("RubyVM::InstructionSequence");
+    VALUE iseq = ProtectFuncall(iseq_class, compile_id, 1, source);
+    if (!RTEST(rb_obj_is_kind_of(iseq, iseq_class)))
+      return Qnil;
+    return rb_str_freeze(source);
+  }
+  VALUE frame_locals = ProtectFuncall(binding, local_variables_id, 0);
+  auto identifiers = GetIdentifiers(expr);
+  std::string params;
+  if (RB_TYPE_P(frame_locals, T_ARRAY)) {
+    for (long i = 0; i < RARRAY_LEN(frame_locals); ++i) {
+      ID local = SYM2ID(RARRAY_AREF(frame_locals, i));
+      if (identifiers.count(rb_id2name(local)) == 0)
+        continue;
+      locals.push_back(local);
+      if (!params.empty())
+        params += ", ";
+      params += rb_id2name(local);
+    }
+  }
+  VALUE proc = EvaluateIsolated("proc { |" + params + "|\n" + expr + "\n}");
+  return rb_obj_is_proc(proc) == Qtrue ? proc : Qnil;
+}
+
+// Calls an expression compiled by CompileExpression() in the frame of the
+// given binding and self. Returns the exception object and sets error if it
+// raised.
+VALUE CallCompiledExpression(VALUE proc, const std::vector<ID>& locals,
+                             VALUE binding, VALUE self, int& error) {
+  VALUE data = rb_ary_new_capa(static_cast<long>(locals.size() + 3));
+  rb_ary_push(data, self);
+  rb_ary_push(data, binding);
+  rb_ary_push(data, proc);
+  for (ID local : locals) {
+    rb_ary_push(data, ID2SYM(local));
+  }
+  error = 0;
+  VALUE result = rb_protect(CallCompiledProc, data, &error);
+  if (error) {
+    result = rb_errinfo();
+    rb_set_errinfo(Qnil);
+  }
+  return result;
+}
+
+// The frames collected by DebugInspectorFunc(), at most max_frames.
+struct StackFramesData {
+  std::vector<StackFrame> frames;
+  size_t max_frames;
+};
+
 VALUE DebugInspectorFunc(const rb_debug_inspector_t* di, void* data) {
-  auto frames = reinterpret_cast<std::vector<StackFrame>*>(data);
+  auto frames_data = reinterpret_cast<StackFramesData*>(data);
+  auto frames = &frames_data->frames;
   VALUE bt = rb_debug_inspector_backtrace_locations(di);
   int bt_count = (int)RARRAY_LEN(bt);
-  for (int i=0; i < bt_count; ++i) {
+  for (int i=0; i < bt_count && frames->size() < frames_data->max_frames; ++i) {
     VALUE bt_val = RARRAY_PTR(bt)[i];
     VALUE path_val = rb_funcall(bt_val, rb_intern("path"), 0);
     if (path_val == Qnil)
@@ -190,6 +525,52 @@ VALUE DebugInspectorFunc(const rb_debug_inspector_t* di, void* data) {
   return Qnil;
 }
 
+// Renders a value captured by a snapshot. Strings are truncated before they
+// are copied and collections are only summarized, to bound the cost.
+std::string RenderSnapshotValue(VALUE value, size_t max_length) {
+  std::string s;
+  if (RB_TYPE_P(value, T_STRING)) {
+    s.assign(RSTRING_PTR(value), std::min(
+        static_cast<size_t>(RSTRING_LEN(value)), max_length + 1));
+  } else if (RB_TYPE_P(value, T_ARRAY)) {
+    s = "#<" + std::string(rb_obj_classname(value)) + " size=" +
+        std::to_string(RARRAY_LEN(value)) + ">";
+  } else if (RB_TYPE_P(value, T_HASH)) {
+    s = "#<" + std::string(rb_obj_classname(value)) + " size=" +
+        std::to_string(RHASH_SIZE(value)) + ">";
+  } else {
+    s = GetRubyObjectAsString(value);
+  }
+  if (s.size() > max_length) {
+    s.resize(max_length);
+    s += "...";
+  }
+  return s;
+}
+
+// Returns the first locals of the frame of the given binding, rendered.
+std::vector<Variable> GetSnapshotLocals(VALUE binding,
+                                        const SnapshotLimits& limits) {
+  std::vector<Variable> locals;
+  static ID local_variables_id = rb_intern("local_variables");
+  static ID local_variable_get_id = rb_intern("local_variable_get");
+  VALUE names = ProtectFuncall(binding, local_variables_id, 0);
+  if (!RB_TYPE_P(names, T_ARRAY))
+    return locals;
+  size_t count = std::min(static_cast<size_t>(RARRAY_LEN(names)),
+                          limits.max_variables);
+  for (size_t i = 0; i < count; ++i) {
+    VALUE name = RARRAY_AREF(names, static_cast<long>(i));
+    VALUE value = ProtectFuncall(binding, local_variable_get_id, 1, name);
+    Variable var;
+    var.name = rb_id2name(SYM2ID(name));
+    var.type = rb_obj_classname(value);
+    var.value = RenderSnapshotValue(value, limits.max_string_length);
+    locals.push_back(var);
+  }
+  return locals;
+}
+
 bool SortBreakPoints(const SketchUp::RubyDebugger::BreakPoint& bp0,
                      const SketchUp::RubyDebugger::BreakPoint& bp1) {
   return bp0.index < bp1.index;
@@ -204,40 +585,188 @@ class Server::Impl {
 public:
   Impl()
     : save_breakpoints_(false),
-      tp_line_(Qnil),
-      tp_return_(Qnil),
-      tp_call_(Qnil),
+      tp_events_(Qnil),
+      tp_script_compiled_(Qnil),
+      breakpoint_tracepoints_(Qnil),
+      step_tracepoints_(Qnil),
+      is_step_targeted_(false),
+      run_to_tracepoint_(Qnil),
+      run_to_line_(0),
+      run_to_pending_(false),
+      step_into_tracepoint_(Qnil),
+      step_into_method_(Qnil),
+      step_into_thread_(Qnil),
+      step_into_pending_(false),
+      until_proc_(Qnil),
+      is_until_frame_known_(false),
+      until_self_(Qnil),
+      until_method_id_(Qnil),
+      tp_raise_(Qnil),
+      catch_points_dirty_(false),
+      catch_classes_(Qnil),
+      function_methods_(Qnil),
+      function_breakpoints_dirty_(false),
+      is_method_added_hooked_(false),
+      allocation_points_dirty_(false),
+      allocation_tracepoints_(Qnil),
+      allocation_generation_(0),
+      are_allocation_points_armed_(false),
+      last_watch_point_index_(0),
+      watch_points_dirty_(false),
+      watch_objects_(Qnil),
+      watch_tracepoints_(Qnil),
+      are_watch_points_armed_(false),
+      path_filter_enabled_(false),
+      path_filter_dirty_(false),
+      traced_threads_(Qnil),
+      trace_events_(0),
+      trace_all_threads_(false),
+      traced_threads_dirty_(true),
+      condition_procs_(Qnil),
+      message_procs_(Qnil),
+      conditions_dirty_(false),
+      last_snapshot_id_(0),
+      is_attached_(false),
+      trace_points_dirty_(false),
+      is_updating_trace_points_(false),
+      pause_requested_(false),
+      dispatch_thread_(Qnil),
+      dispatch_pending_(false),
+      is_dispatch_stopped_(false),
       last_breakpoint_index(0),
       script_lines_hash_(Qnil),
       is_stopped_(false),
       break_at_next_line_(false),
-      stepout_break_at_next_line_(false),
-      stepover_break_at_next_line_(false),
-      stepout_to_call_depth_(-1),
-      stepover_to_call_depth_(-1),
+      suspended_thread_id_(0),
+      is_suspending_(false),
+      suspension_unblocked_(false),
+      frame_values_(Qnil),
       active_frame_index_(0),
-      last_break_line_(0),
-      call_depth_(0)
-  {}
+      last_break_line_(0)
+  {
+    std::fill(std::begin(path_cache_keys_), std::end(path_cache_keys_), Qnil);
+    std::fill(std::begin(path_cache_values_), std::end(path_cache_values_),
+              nullptr);
+  }
 
   void EnableTracePoint();
 
   void DisableTracePoint();
 
+  void UpdateTracePoints();
+
+  void DoUpdateTracePoints();
+
+  void RequestTracePointUpdate();
+
+  void RequestPause();
+
+  void ArmPause();
+
+  void WakeDispatchThread();
+
+  void SetTraceEvents(rb_event_flag_t events);
+
+  bool IsSteppingPending() const;
+
+  void ArmBreakPoint(const BreakPoint& bp, VALUE iseq);
+
+  void DisarmBreakPoint(size_t index);
+
+  void ResolveFunctionBreakPoints();
+
+  void ArmFunctionBreakPoint(const BreakPoint& bp, VALUE method);
+
+  void DisarmCFunctionBreakPoints();
+
+  void HookMethodAdded();
+
+  void MethodAdded(VALUE self, VALUE name, bool is_singleton);
+
+  void StartDispatchThread();
+
+  void StopDispatchThread();
+
+  void UpdateTracedThreads();
+
+  bool IsTracedThread(VALUE thread) const;
+
   BreakPoint* GetBreakPoint(const std::string& file, size_t line);
 
   BreakPoint* GetBreakPoint(size_t index);
 
-  bool IsBreakPointActive(const BreakPoint &bp);
+  static bool CountHit(BreakPoint* bp, BreakPoint& hit);
+
+  bool HitBreakPoint(const std::string& file, size_t line, BreakPoint& hit);
+
+  bool HitBreakPoint(size_t index, BreakPoint& hit);
+
+  bool IsBreakPointActive(const BreakPoint &bp, rb_trace_arg_t* trace_arg);
+
+  // A breakpoint condition compiled on its first evaluation.
+  struct CompiledCondition {
+    typedef NativeCondition::Result Result;
+
+    CompiledCondition()
+      : evaluations(0),
+        errors(0),
+        evaluation_time(std::chrono::steady_clock::duration::zero()),
+        overruns(0),
+        quarantined(false) {}
+
+    // The condition compiled, empty until it is.
+    std::string condition;
+    NativeCondition native;
+    // The locals of the frame the proc takes as arguments.
+    std::vector<ID> locals;
+    size_t evaluations;
+    size_t errors;
+    std::chrono::steady_clock::duration evaluation_time;
+    // Consecutive evaluations over kConditionBudgetMs.
+    size_t overruns;
+    // Set once the condition raised too often or took too long. It is not
+    // evaluated anymore and the breakpoint does not break until the
+    // condition is changed or reset.
+    bool quarantined;
+  };
+
+  // A condition is quarantined after raising this many times.
+  static const size_t kConditionMaxErrors = 3;
+
+  // Or if this many consecutive evaluations take longer than
+  // kConditionBudgetMs. A single one may include a thread switch or a GC.
+  static const size_t kConditionMaxOverruns = 3;
+
+  static const int kConditionBudgetMs = 50;
+
+  void CompileCondition(const BreakPoint& bp, VALUE binding,
+                        CompiledCondition& compiled);
+
+  CompiledCondition::Result EvaluateCondition(const BreakPoint& bp,
+                                              VALUE binding, VALUE self,
+                                              CompiledCondition& compiled);
+
+  void QuarantineCondition(const BreakPoint& bp, CompiledCondition& compiled,
+                           const std::string& reason);
+
+  void DropStaleConditions();
+
+  void LogPointHit(const BreakPoint& bp, rb_trace_arg_t* trace_arg);
 
-  void ReadScriptLinesHash();
+  void TakeSnapshot(const BreakPoint& bp, rb_trace_arg_t* trace_arg);
 
-  bool ResolveBreakPoint(BreakPoint& bp);
+  void ReadScriptLines(const std::string& file_path);
 
-  void ResolveBreakPoints();
+  bool ResolveBreakPoint(BreakPoint& bp, const std::string& file_path) const;
+
+  bool ResolveBreakPoint(BreakPoint& bp) const;
+
+  void ResolveBreakPoints(const std::string& file_path);
 
   void AddBreakPoint(BreakPoint& bp, bool is_resolved);
 
+  void AddFunctionBreakPoint(BreakPoint& bp);
+
   void ClearBreakData();
 
   void ClearSuspensionData();
@@ -246,33 +775,371 @@ public:
 
   void LoadBreakPoints();
 
-  void DoBreak(const std::string& file_path, size_t line);
+  void DoBreak(const std::string& file_path, size_t line,
+               VALUE exception = Qnil);
 
-  void DoBreak(const BreakPoint& bp);
+  void DoBreak(const BreakPoint& bp, rb_trace_arg_t* trace_arg);
 
   VALUE GetBinding(bool use_toplevel_binding);
 
-  static std::vector<StackFrame> GetStackFrames();
+  static std::vector<StackFrame> GetStackFrames(
+      size_t max_frames = std::numeric_limits<size_t>::max());
+
+  const ScriptFile& GetScriptFile(VALUE path_val);
+
+  ThreadState& GetThreadState();
+
+  void UpdateThreadList();
+
+  void BeginSuspension();
+
+  void EndSuspension();
+
+  void RetainFrames();
+
+  static void* WaitForSuspensionEnd(void* data);
+
+  static void UnblockSuspensionWait(void* data);
+
+  static void TraceEvent(VALUE tp_val, void* data);
+
+  static void BreakPointEvent(VALUE tp_val, void* data);
+
+  static void StepEvent(VALUE tp_val, void* data);
+
+  static void RunToEvent(VALUE tp_val, void* data);
+
+  static void StepIntoEvent(VALUE tp_val, void* data);
 
-  static void LineEvent(VALUE tp_val, void* data);
+  static void RaiseEvent(VALUE tp_val, void* data);
 
-  static void ReturnEvent(VALUE tp_val, void* data);
+  static void FunctionBreakPointEvent(VALUE tp_val, void* data);
 
-  static void CallEvent(VALUE tp_val, void* data);
+  void FunctionBreakPointHit(size_t index, rb_trace_arg_t* trace_arg);
+
+  static VALUE MethodAddedHook(VALUE self, VALUE name);
+
+  static VALUE SingletonMethodAddedHook(VALUE self, VALUE name);
+
+  bool IsCaught(VALUE klass);
+
+  void UpdateCatchPoints();
+
+  static void AllocationEvent(VALUE tp_val, void* data);
+
+  void UpdateAllocationPoints();
+
+  static void WatchEvent(VALUE tp_val, void* data);
+
+  void UpdateWatchPoints();
+
+  void ArmWatchedClass(VALUE klass);
+
+  void ArmWatchedMethod(VALUE module, VALUE name);
+
+  bool IsUntilSatisfied(ThreadState& state, rb_trace_arg_t* trace_arg);
+
+  void UpdateRunTo();
+
+  void UpdateStepInto(bool pending);
+
+  void UpdatePathFilter();
+
+  void ArmStepTracePoints();
+
+  void ArmStepTracePoint(VALUE iseq);
+
+  void DisarmStepTracePoints();
+
+  static void ScriptCompiledEvent(VALUE tp_val, void* data);
+
+  static VALUE DispatchThreadFunc(void* data);
+
+  static void* WaitForDispatch(void* data);
+
+  static void UnblockDispatch(void* data);
 
   std::unique_ptr<IDebuggerUI> ui_;
 
   bool save_breakpoints_;
 
-  VALUE tp_line_;
+  // Line, call and return hooks, one for each traced thread. Recreated when
+  // the traced events or threads change.
+  VALUE tp_events_;
+
+  VALUE tp_script_compiled_;
+
+  // Hash of breakpoint index => array of line tracepoints targeted at the
+  // instruction sequences of the breakpoint's file.
+  VALUE breakpoint_tracepoints_;
+
+  // Step hooks targeted at the code of each file which the path filter does
+  // not exclude. Only armed while stepping with a path filter.
+  VALUE step_tracepoints_;
+
+  bool is_step_targeted_;
+
+  // Temporary line tracepoint of a run-to command, disarmed on its first hit
+  // or at any other suspension. Never stored with the breakpoints.
+  VALUE run_to_tracepoint_;
+
+  std::string run_to_file_;
+
+  size_t run_to_line_;
+
+  bool run_to_pending_;
+
+  // Call tracepoint targeted at the method of a step-into command. Only hit
+  // by the thread which gave the command, and disarmed like run-to.
+  VALUE step_into_tracepoint_;
+
+  // The method of a step-into command until UpdateTracePoints() arms it.
+  VALUE step_into_method_;
+
+  VALUE step_into_thread_;
+
+  bool step_into_pending_;
+
+  // Predicate of the pending until command, compiled once when the command
+  // is given, natively if it is simple enough and like a condition in any
+  // case. The proc takes until_locals_ from each frame it is evaluated in.
+  NativeCondition until_native_;
+
+  VALUE until_proc_;
+
+  std::vector<ID> until_locals_;
+
+  // The frame an until command steps in, by its self and method, taken from
+  // its first line. Blocks of other frames are not evaluated.
+  bool is_until_frame_known_;
+
+  VALUE until_self_;
+
+  VALUE until_method_id_;
+
+  // RUBY_EVENT_RAISE hook, only enabled while there are catch points.
+  VALUE tp_raise_;
+
+  // Names of the exception classes which suspend when raised, set by the UI.
+  std::vector<std::string> catch_points_;
+
+  std::atomic<bool> catch_points_dirty_;
+
+  // Copy of catch_points_ for the raise hook, made by UpdateTracePoints().
+  std::vector<std::string> catch_names_;
+
+  // Identity hash of each raised class => whether one of its ancestors is
+  // caught, filled by the raise hook. Cleared when the catch points change.
+  VALUE catch_classes_;
+
+  static const size_t kMaxCatchClasses = 1024;
+
+  // A tracepoint of an armed function breakpoint. The c_call hooks of C
+  // methods are not targeted, so their events are filtered by name and owner.
+  struct ArmedFunction {
+    size_t index;
+    VALUE tracepoint;
+    ID method_id;
+    VALUE owner;
+    // Threshold of a latency breakpoint, zero for a plain one.
+    std::chrono::steady_clock::duration latency;
+    // Whether this is the c_call hook of one of the traced threads.
+    bool is_c_method;
+  };
+
+  // Only accessed by Ruby threads. The tracepoints and owners are kept alive
+  // by breakpoint_tracepoints_ and function_methods_.
+  std::vector<ArmedFunction> armed_functions_;
+
+  // Hash of function breakpoint index => the resolved Method or
+  // UnboundMethod, until the breakpoint is disarmed.
+  VALUE function_methods_;
+
+  // An enabled function breakpoint, as looked up by the method_added hook.
+  struct FunctionName {
+    size_t index;
+    // The constant path of the class or module, e.g. "Klass" for
+    // "Klass#name".
+    std::string owner;
+    bool is_singleton;
+  };
+
+  // Method name => each enabled function breakpoint, rebuilt by
+  // UpdateTracePoints().
+  std::multimap<ID, FunctionName> function_names_;
+
+  // Set when the function breakpoints need to be resolved again.
+  std::atomic<bool> function_breakpoints_dirty_;
+
+  // Whether method_added and singleton_method_added are hooked. The hooks
+  // cannot be removed, they only do a lookup in function_names_.
+  bool is_method_added_hooked_;
+
+  // Allocation points set by the UI.
+  std::vector<AllocationPoint> allocation_points_;
+
+  // Set when the allocation points or the loaded scripts change.
+  std::atomic<bool> allocation_points_dirty_;
+
+  // A tracepoint of kAllocationEvents targeted at a loaded script which
+  // matches an allocation point.
+  struct ArmedAllocation {
+    VALUE tracepoint;
+    size_t max_objects;
+  };
+
+  // Only accessed by Ruby threads. The tracepoints are kept alive by
+  // allocation_tracepoints_.
+  std::vector<ArmedAllocation> armed_allocations_;
+
+  VALUE allocation_tracepoints_;
+
+  // Incremented each time the allocation tracepoints are armed again, which
+  // drops the frames recorded by each thread.
+  size_t allocation_generation_;
+
+  bool are_allocation_points_armed_;
+
+  // Watch points set by the UI.
+  std::vector<WatchPoint> watch_points_;
+
+  size_t last_watch_point_index_;
+
+  std::atomic<bool> watch_points_dirty_;
+
+  // Hash of watch point index => [object, last seen value of the variable].
+  // Keeps the watched objects alive until their watch point is removed.
+  VALUE watch_objects_;
+
+  // A watch point armed by UpdateWatchPoints(), only accessed by Ruby threads.
+  struct ArmedWatch {
+    size_t index;
+    VALUE entry;
+    ID ivar_id;
+  };
 
-  VALUE tp_return_;
+  std::vector<ArmedWatch> armed_watches_;
 
-  VALUE tp_call_;
+  // Line and return tracepoints targeted at the methods of the classes of the
+  // watched objects.
+  VALUE watch_tracepoints_;
+
+  bool are_watch_points_armed_;
+
+  // Include and exclude rules set by the UI, compiled into path_filter_ by
+  // UpdateTracePoints().
+  std::vector<std::pair<std::string, PathFilter::Rule>> path_filter_rules_;
+
+  bool path_filter_enabled_;
+
+  std::atomic<bool> path_filter_dirty_;
+
+  // Only used by Ruby threads.
+  PathFilter path_filter_;
+
+  // Top-level instruction sequences of the loaded scripts, by path. Only
+  // changed by Ruby threads with break_point_mutex_ locked, so Ruby threads
+  // read it without locking.
+  std::map<std::string, VALUE, CaseInsensitiveStringSort> script_iseqs_;
+
+  // Array of the threads which are traced, or [nil] to trace all threads.
+  VALUE traced_threads_;
+
+  // Events currently traced by tp_events_.
+  rb_event_flag_t trace_events_;
+
+  // Ids of the threads selected by SetTracedThreads(). The main thread is
+  // traced if none are selected.
+  std::vector<size_t> traced_thread_ids_;
+
+  bool trace_all_threads_;
+
+  // Set when traced_threads_ needs to be rebuilt from the selected ids.
+  std::atomic<bool> traced_threads_dirty_;
+
+  // The traced scripts. Each path is converted to a std::string only the first
+  // time it is seen. Each file holds a bitmap of the lines with breakpoints,
+  // rebuilt by UpdateTracePoints().
+  ScriptFiles script_files_;
+
+  // Direct-mapped cache of path VALUE => entry in script_files_. The keys are
+  // registered with the GC so that a cached VALUE is never reused for another
+  // string.
+  static const size_t kPathCacheSize = 16;
+
+  VALUE path_cache_keys_[kPathCacheSize];
+
+  const ScriptFile* path_cache_values_[kPathCacheSize];
+
+  // The compiled breakpoint conditions, by breakpoint index. Only accessed by
+  // Ruby threads.
+  std::map<size_t, CompiledCondition> compiled_conditions_;
+
+  // The procs of compiled_conditions_, by breakpoint index. Missing if the
+  // condition did not compile.
+  VALUE condition_procs_;
+
+  // A logpoint message compiled on its first evaluation.
+  struct CompiledMessage {
+    // The message compiled, empty until it is.
+    std::string message;
+    // The locals of the frame the proc takes as arguments.
+    std::vector<ID> locals;
+  };
+
+  // The compiled logpoint messages, by breakpoint index. Only accessed by Ruby
+  // threads.
+  std::map<size_t, CompiledMessage> compiled_messages_;
+
+  // The procs of compiled_messages_, by breakpoint index. Missing if the
+  // message did not compile.
+  VALUE message_procs_;
+
+  // Set by ConditionBreakPoint(), LogBreakPoint(), RemoveBreakPoint() and
+  // RemoveAllBreakPoints() until the compiled conditions and messages are
+  // dropped.
+  std::atomic<bool> conditions_dirty_;
+
+  // The snapshots captured by snapshot breakpoints, oldest first, and the
+  // limits applied when capturing them. Guarded by snapshots_mutex_.
+  std::deque<Snapshot> snapshots_;
+  size_t last_snapshot_id_;
+  SnapshotLimits snapshot_limits_;
+  mutable std::mutex snapshots_mutex_;
+
+  // Nothing but the script_compiled hook is enabled while no debugger client
+  // is attached.
+  std::atomic<bool> is_attached_;
+
+  // Set when breakpoints or stepping changed and the tracepoints need to be
+  // updated from a Ruby thread.
+  std::atomic<bool> trace_points_dirty_;
+
+  // Set while a Ruby thread runs UpdateTracePoints(). Others leave their
+  // update to it.
+  bool is_updating_trace_points_;
+
+  // Set by Pause() until the dispatch thread has enabled the line event.
+  std::atomic<bool> pause_requested_;
+
+  // The debugger's own Ruby thread, never traced.
+  VALUE dispatch_thread_;
+
+  bool dispatch_pending_;
+
+  // Set by Stop() to let the dispatch thread return.
+  std::atomic<bool> is_dispatch_stopped_;
+
+  std::mutex dispatch_mutex_;
+
+  std::condition_variable dispatch_cond_;
 
   // Breakpoints with yet-unresolved file paths
   std::vector<BreakPoint> unresolved_breakpoints_;
 
+  // Breakpoints on methods, see BreakPoint::method.
+  std::vector<BreakPoint> function_breakpoints_;
+
   BreakPointsMap breakpoints_;
 
   size_t last_breakpoint_index;
@@ -285,15 +1152,32 @@ public:
 
   std::atomic<bool> is_stopped_;
 
+  // Set by a pause, stops whichever traced thread runs the next line.
   std::atomic<bool> break_at_next_line_;
 
-  std::atomic<bool> stepout_break_at_next_line_;
+  // Stepping state of each Ruby thread, see GetThreadState().
+  ThreadStates thread_states_;
 
-  std::atomic<bool> stepover_break_at_next_line_;
+  // Id of the thread which is suspended, 0 while running.
+  std::atomic<size_t> suspended_thread_id_;
 
-  std::atomic<size_t> stepout_to_call_depth_;
+  // Ruby threads as of the last suspension.
+  std::vector<ThreadInfo> threads_;
 
-  std::atomic<size_t> stepover_to_call_depth_;
+  std::mutex threads_mutex_;
+
+  // Other Ruby threads keep running while one is suspended. Only one thread
+  // is suspended at a time, the others wait for it in BeginSuspension().
+  bool is_suspending_;
+
+  bool suspension_unblocked_;
+
+  std::mutex suspension_mutex_;
+
+  std::condition_variable suspension_cond_;
+
+  // Keeps the bindings and objects of frames_ alive while suspended.
+  VALUE frame_values_;
 
   std::vector<StackFrame> frames_;
 
@@ -302,66 +1186,729 @@ public:
   std::string last_break_file_path_;
 
   size_t last_break_line_;
-
-  size_t call_depth_;
 };
 
 void Server::Impl::ClearBreakData() {
   frames_.clear();
+  if (frame_values_ != Qnil)
+    rb_ary_clear(frame_values_);
   is_stopped_ = false;
+  suspended_thread_id_ = 0;
 }
 
 void Server::Impl::EnableTracePoint() {
-  tp_line_ = rb_tracepoint_new(Qnil, RUBY_EVENT_LINE, &LineEvent, this);
-  rb_tracepoint_enable(tp_line_);
-
-  tp_return_ = rb_tracepoint_new(Qnil, RUBY_EVENT_RETURN |
-      RUBY_EVENT_B_RETURN | RUBY_EVENT_C_RETURN | RUBY_EVENT_END,
-      &ReturnEvent, this);
-  rb_tracepoint_enable(tp_return_);
-
-  tp_call_ = rb_tracepoint_new(Qnil, RUBY_EVENT_CALL | RUBY_EVENT_B_CALL |
-      RUBY_EVENT_C_CALL | RUBY_EVENT_CLASS, &CallEvent, this);
-  rb_tracepoint_enable(tp_call_);
-  /*
+  // The line, call and return hooks are enabled by UpdateTracePoints().
+  tp_events_ = rb_ary_new();
+  rb_gc_register_address(&tp_events_);
+  traced_threads_ = rb_ary_new();
+  rb_gc_register_address(&traced_threads_);
+  frame_values_ = rb_ary_new();
+  rb_gc_register_address(&frame_values_);
+  for (size_t i = 0; i < kPathCacheSize; ++i) {
+    rb_gc_register_address(&path_cache_keys_[i]);
+  }
+
+  breakpoint_tracepoints_ = rb_hash_new();
+  rb_gc_register_address(&breakpoint_tracepoints_);
+  step_tracepoints_ = rb_ary_new();
+  rb_gc_register_address(&step_tracepoints_);
+  rb_gc_register_address(&run_to_tracepoint_);
+  rb_gc_register_address(&step_into_tracepoint_);
+  rb_gc_register_address(&step_into_method_);
+  rb_gc_register_address(&step_into_thread_);
+  rb_gc_register_address(&until_proc_);
+  rb_gc_register_address(&until_self_);
+  condition_procs_ = rb_hash_new();
+  rb_gc_register_address(&condition_procs_);
+  message_procs_ = rb_hash_new();
+  rb_gc_register_address(&message_procs_);
+  catch_classes_ = rb_hash_new();
+  rb_funcall(catch_classes_, rb_intern("compare_by_identity"), 0);
+  rb_gc_register_address(&catch_classes_);
+  function_methods_ = rb_hash_new();
+  rb_gc_register_address(&function_methods_);
+  allocation_tracepoints_ = rb_ary_new();
+  rb_gc_register_address(&allocation_tracepoints_);
+  watch_objects_ = rb_hash_new();
+  rb_gc_register_address(&watch_objects_);
+  watch_tracepoints_ = rb_ary_new();
+  rb_gc_register_address(&watch_tracepoints_);
+
+  tp_script_compiled_ = rb_tracepoint_new(Qnil, RUBY_EVENT_SCRIPT_COMPILED,
+                                          &ScriptCompiledEvent, this);
+  rb_tracepoint_enable(tp_script_compiled_);
+  // Enabled by UpdateTracePoints().
   tp_raise_ = rb_tracepoint_new(Qnil, RUBY_EVENT_RAISE, &RaiseEvent, this);
-  rb_tracepoint_enable(tp_raise_);
-  */
+  rb_gc_register_address(&tp_raise_);
 }
 
 void Server::Impl::DisableTracePoint() {
-  if (tp_line_ != Qnil) {
-    rb_tracepoint_disable(tp_line_);
-    tp_line_ = Qnil;
+  SetTraceEvents(0);
+  if (tp_script_compiled_ != Qnil) {
+    rb_tracepoint_disable(tp_script_compiled_);
+    tp_script_compiled_ = Qnil;
   }
-  if (tp_return_ != Qnil) {
-    rb_tracepoint_disable(tp_return_);
-    tp_return_ = Qnil;
+  {
+    // No script is recorded anymore, let go of the instruction sequences.
+    std::lock_guard<std::mutex> lock(break_point_mutex_);
+    for (auto& it : script_iseqs_) {
+      rb_gc_unregister_address(&it.second);
+    }
+    script_iseqs_.clear();
   }
-  if (tp_call_ != Qnil) {
-    rb_tracepoint_disable(tp_call_);
-    tp_call_ = Qnil;
+  if (tp_raise_ != Qnil)
+    rb_tracepoint_disable(tp_raise_);
+  if (allocation_tracepoints_ != Qnil) {
+    for (long i = 0; i < RARRAY_LEN(allocation_tracepoints_); ++i) {
+      rb_tracepoint_disable(rb_ary_entry(allocation_tracepoints_, i));
+    }
   }
-}
-
-BreakPoint* Server::Impl::GetBreakPoint(const std::string& file, size_t line) {
-  BreakPoint* bp = nullptr;
-  auto it = breakpoints_.find(line);
-  if (it != breakpoints_.end()) {
-    auto itf = it->second.find(file);
-    if (itf != it->second.end()) {
-      bp = &(itf->second);
+  if (watch_tracepoints_ != Qnil) {
+    for (long i = 0; i < RARRAY_LEN(watch_tracepoints_); ++i) {
+      rb_tracepoint_disable(rb_ary_entry(watch_tracepoints_, i));
+    }
+  }
+  if (breakpoint_tracepoints_ != Qnil) {
+    VALUE indices = rb_funcall(breakpoint_tracepoints_, rb_intern("keys"), 0);
+    for (long i = 0; i < RARRAY_LEN(indices); ++i) {
+      DisarmBreakPoint(NUM2SIZET(rb_ary_entry(indices, i)));
     }
   }
-  return bp;
 }
 
-BreakPoint* Server::Impl::GetBreakPoint(size_t index) {
-  // Check resolved breakpoints
-  for (auto it = breakpoints_.begin(), ite = breakpoints_.end(); it != ite; ++it) {
-    auto& map = it->second;
-    for (auto itm = map.begin(), itme = map.end(); itm != itme; ++itm) {
-      if (itm->second.index == index) return &(itm->second);
+void Server::Impl::SetTraceEvents(rb_event_flag_t events) {
+  if (trace_events_ == events)
+    return;
+  if (tp_events_ == Qnil)
+    return;
+  for (long i = 0; i < RARRAY_LEN(tp_events_); ++i) {
+    rb_tracepoint_disable(rb_ary_entry(tp_events_, i));
+  }
+  rb_ary_clear(tp_events_);
+  if (events != 0) {
+    // Threads which are not traced do not run any hook at all.
+    for (long i = 0; i < RARRAY_LEN(traced_threads_); ++i) {
+      VALUE tp = rb_tracepoint_new(rb_ary_entry(traced_threads_, i), events,
+                                   &TraceEvent, this);
+      rb_ary_push(tp_events_, tp);
+      rb_tracepoint_enable(tp);
+    }
+  }
+  trace_events_ = events;
+}
+
+// Looks up the threads selected by id.
+void Server::Impl::UpdateTracedThreads() {
+  traced_threads_dirty_ = false;
+  std::vector<size_t> thread_ids;
+  bool all_threads = false;
+  {
+    std::lock_guard<std::mutex> lock(break_point_mutex_);
+    thread_ids = traced_thread_ids_;
+    all_threads = trace_all_threads_;
+  }
+  rb_ary_clear(traced_threads_);
+  if (all_threads) {
+    rb_ary_push(traced_threads_, Qnil);
+    return;
+  }
+
+  // Threads which were asked to stop, or to step while suspended, are traced
+  // until they do.
+  std::vector<size_t> stepping_ids = thread_states_.GetSteppingIds();
+  if (!thread_ids.empty() || !stepping_ids.empty()) {
+    VALUE threads = rb_funcall(rb_cThread, rb_intern("list"), 0);
+    for (long i = 0; i < RARRAY_LEN(threads); ++i) {
+      VALUE thread = rb_ary_entry(threads, i);
+      size_t id = NUM2SIZET(rb_obj_id(thread));
+      if (std::find(thread_ids.cbegin(), thread_ids.cend(), id) !=
+          thread_ids.cend() ||
+          std::find(stepping_ids.cbegin(), stepping_ids.cend(), id) !=
+          stepping_ids.cend()) {
+        rb_ary_push(traced_threads_, thread);
+      }
+    }
+  }
+  if (thread_ids.empty()) {
+    VALUE main_thread = rb_thread_main();
+    if (!RTEST(rb_ary_includes(traced_threads_, main_thread)))
+      rb_ary_push(traced_threads_, main_thread);
+  } else if (RARRAY_LEN(traced_threads_) == 0) {
+    LOG("None of the selected threads exist, tracing the main thread.");
+    rb_ary_push(traced_threads_, rb_thread_main());
+  }
+}
+
+bool Server::Impl::IsTracedThread(VALUE thread) const {
+  if (thread == dispatch_thread_)
+    return false;
+  for (long i = 0; i < RARRAY_LEN(traced_threads_); ++i) {
+    VALUE traced = rb_ary_entry(traced_threads_, i);
+    if (traced == Qnil || traced == thread)
+      return true;
+  }
+  return false;
+}
+
+bool Server::Impl::IsSteppingPending() const {
+  return break_at_next_line_ || thread_states_.IsSteppingPending();
+}
+
+// Arms a line tracepoint targeted at the given instruction sequence and the
+// breakpoint's line. The line of a def is only run when the method is
+// defined, so a call tracepoint is armed as well for a method which starts at
+// the line. A breakpoint can be armed several times when its file is loaded
+// again.
+void Server::Impl::ArmBreakPoint(const BreakPoint& bp, VALUE iseq) {
+  VALUE index_val = SIZET2NUM(bp.index);
+  VALUE tps = rb_hash_lookup(breakpoint_tracepoints_, index_val);
+  if (tps == Qnil) {
+    tps = rb_ary_new();
+    rb_hash_aset(breakpoint_tracepoints_, index_val, tps);
+  }
+
+  VALUE tp = rb_tracepoint_new(Qnil, RUBY_EVENT_LINE, &BreakPointEvent, this);
+  if (EnableTracePointForTarget(tp, iseq, bp.line)) {
+    rb_ary_push(tps, tp);
+  } else {
+    // No code at this line, so the breakpoint can never be hit.
+    LOG(FMT("Cannot arm breakpoint " << bp.index << " at " << bp.file << ':'
+            << bp.line));
+  }
+
+  // Blocks and class bodies have no call events and are not armed.
+  VALUE children = GetIseqsAtLine(iseq, bp.line);
+  for (long i = 0; i < RARRAY_LEN(children); ++i) {
+    VALUE call_tp = rb_tracepoint_new(Qnil, RUBY_EVENT_CALL, &BreakPointEvent,
+                                      this);
+    if (EnableTracePointForTarget(call_tp, RARRAY_AREF(children, i), 0))
+      rb_ary_push(tps, call_tp);
+  }
+}
+
+void Server::Impl::DisarmBreakPoint(size_t index) {
+  VALUE tps = rb_hash_delete(breakpoint_tracepoints_, SIZET2NUM(index));
+  if (tps != Qnil) {
+    for (long i = 0; i < RARRAY_LEN(tps); ++i) {
+      rb_tracepoint_disable(rb_ary_entry(tps, i));
+    }
+  }
+  if (rb_hash_delete(function_methods_, SIZET2NUM(index)) != Qnil) {
+    armed_functions_.erase(
+        std::remove_if(armed_functions_.begin(), armed_functions_.end(),
+                       [index](const ArmedFunction& function) {
+                         return function.index == index;
+                       }),
+        armed_functions_.end());
+  }
+}
+
+// Looks up the methods of the enabled function breakpoints which are not
+// armed yet. Called without break_point_mutex_ locked, since looking up a
+// constant may autoload a file.
+void Server::Impl::ResolveFunctionBreakPoints() {
+  std::vector<std::pair<size_t, std::string>> methods;
+  {
+    std::lock_guard<std::mutex> lock(break_point_mutex_);
+    for (const auto& bp : function_breakpoints_) {
+      if (bp.enabled)
+        methods.push_back(std::make_pair(bp.index, bp.method));
+    }
+  }
+  if (methods.empty())
+    return;
+
+  // Methods which are not defined yet are resolved when they are.
+  HookMethodAdded();
+  for (const auto& method : methods) {
+    if (rb_hash_lookup(breakpoint_tracepoints_, SIZET2NUM(method.first)) != Qnil)
+      continue;
+    VALUE method_val = ResolveMethod(method.second);
+    if (RTEST(rb_obj_is_kind_of(method_val, rb_cMethod)) ||
+        RTEST(rb_obj_is_kind_of(method_val, rb_cUnboundMethod))) {
+      rb_hash_aset(function_methods_, SIZET2NUM(method.first), method_val);
+    }
+  }
+}
+
+// Arms a call tracepoint targeted at the method of a function breakpoint, and
+// a return tracepoint for a latency breakpoint. Methods defined in C have no
+// instruction sequence to target, so they are caught by a c_call hook of
+// each traced thread instead.
+void Server::Impl::ArmFunctionBreakPoint(const BreakPoint& bp, VALUE method) {
+  static ID original_name_id = rb_intern("original_name");
+  static ID owner_id = rb_intern("owner");
+  ArmedFunction function;
+  function.index = bp.index;
+  function.method_id = SYM2ID(rb_funcall(method, original_name_id, 0));
+  function.owner = rb_funcall(method, owner_id, 0);
+  function.latency = std::chrono::milliseconds(bp.latency_ms);
+  function.is_c_method = false;
+
+  VALUE tps = rb_ary_new();
+  rb_hash_aset(breakpoint_tracepoints_, SIZET2NUM(bp.index), tps);
+  rb_event_flag_t events = RUBY_EVENT_CALL;
+  if (bp.latency_ms != 0)
+    events |= RUBY_EVENT_RETURN;
+  VALUE tp = rb_tracepoint_new(Qnil, events, &FunctionBreakPointEvent, this);
+  if (EnableTracePointForTarget(tp, method, 0)) {
+    rb_ary_push(tps, tp);
+    function.tracepoint = tp;
+    armed_functions_.push_back(function);
+    return;
+  }
+
+  // Like the line hooks, the c_call hooks only run in the traced threads.
+  events = RUBY_EVENT_C_CALL;
+  if (bp.latency_ms != 0)
+    events |= RUBY_EVENT_C_RETURN;
+  function.is_c_method = true;
+  for (long i = 0; i < RARRAY_LEN(traced_threads_); ++i) {
+    tp = rb_tracepoint_new(rb_ary_entry(traced_threads_, i), events,
+                           &FunctionBreakPointEvent, this);
+    rb_ary_push(tps, tp);
+    rb_tracepoint_enable(tp);
+    function.tracepoint = tp;
+    armed_functions_.push_back(function);
+  }
+}
+
+// Disarms the function breakpoints on C methods, which are armed again for
+// the traced threads. Their methods stay resolved.
+void Server::Impl::DisarmCFunctionBreakPoints() {
+  std::set<size_t> indices;
+  for (const auto& function : armed_functions_) {
+    if (function.is_c_method)
+      indices.insert(function.index);
+  }
+  for (size_t index : indices) {
+    VALUE index_val = SIZET2NUM(index);
+    VALUE method = rb_hash_lookup(function_methods_, index_val);
+    DisarmBreakPoint(index);
+    rb_hash_aset(function_methods_, index_val, method);
+  }
+}
+
+// Prepends method_added to Module and singleton_method_added to BasicObject,
+// the first time a function breakpoint is resolved or a watch point is armed.
+// Classes which override these without calling super are not seen.
+void Server::Impl::HookMethodAdded() {
+  if (is_method_added_hooked_)
+    return;
+  is_method_added_hooked_ = true;
+  VALUE module = rb_module_new();
+  rb_define_private_method(module, "method_added",
+                           RUBY_METHOD_FUNC(MethodAddedHook), 1);
+  rb_prepend_module(rb_cModule, module);
+  VALUE singleton_module = rb_module_new();
+  rb_define_private_method(singleton_module, "singleton_method_added",
+                           RUBY_METHOD_FUNC(SingletonMethodAddedHook), 1);
+  rb_prepend_module(rb_cBasicObject, singleton_module);
+}
+
+VALUE Server::Impl::MethodAddedHook(VALUE self, VALUE name) {
+  VALUE result = rb_call_super(1, &name);
+  Server::Instance().impl_->MethodAdded(self, name, false);
+  return result;
+}
+
+VALUE Server::Impl::SingletonMethodAddedHook(VALUE self, VALUE name) {
+  VALUE result = rb_call_super(1, &name);
+  Server::Instance().impl_->MethodAdded(self, name, true);
+  return result;
+}
+
+// Disarms the function breakpoints on a method which was just defined in a
+// module, or as a singleton method of an object, since their tracepoint
+// targets the old code. A breakpoint matches by the name of the module, or
+// by the module its method was resolved to, e.g. an ancestor. The dispatch
+// thread resolves and arms the breakpoints again. The method is traced right
+// away if it belongs to a watched class.
+void Server::Impl::MethodAdded(VALUE self, VALUE name, bool is_singleton) {
+  if (!SYMBOL_P(name))
+    return;
+  VALUE owner = is_singleton ? CLASS_OF(self) : self;
+  if (are_watch_points_armed_)
+    ArmWatchedMethod(owner, name);
+  if (function_names_.empty())
+    return;
+  auto range = function_names_.equal_range(SYM2ID(name));
+  if (range.first == range.second)
+    return;
+
+  std::string owner_name;
+  if (RB_TYPE_P(self, T_MODULE) || RB_TYPE_P(self, T_CLASS)) {
+    VALUE module_name = rb_mod_name(self);
+    if (module_name != Qnil)
+      owner_name.assign(RSTRING_PTR(module_name), RSTRING_LEN(module_name));
+  }
+  std::vector<size_t> indices;
+  for (auto it = range.first; it != range.second; ++it) {
+    const FunctionName& function = it->second;
+    if ((function.is_singleton == is_singleton && !owner_name.empty() &&
+         function.owner == owner_name) ||
+        std::any_of(armed_functions_.cbegin(), armed_functions_.cend(),
+                    [&function, owner](const ArmedFunction& armed) {
+                      return armed.index == function.index &&
+                             armed.owner == owner;
+                    })) {
+      indices.push_back(function.index);
+    }
+  }
+  if (indices.empty())
+    return;
+
+  for (size_t index : indices) {
+    DisarmBreakPoint(index);
+  }
+  function_breakpoints_dirty_ = true;
+  RequestTracePointUpdate();
+  // Let the dispatch thread arm the new method before it is called.
+  rb_thread_schedule();
+}
+
+// Brings the tracepoints in line with the breakpoints and the stepping state.
+// Must be called from a Ruby thread. Other Ruby threads may run whenever Ruby
+// is called during the update, and an update they request is done by the
+// thread which is already updating.
+void Server::Impl::UpdateTracePoints() {
+  if (tp_script_compiled_ == Qnil)
+    return;
+  if (is_updating_trace_points_) {
+    trace_points_dirty_ = true;
+    return;
+  }
+  is_updating_trace_points_ = true;
+  do {
+    DoUpdateTracePoints();
+  } while (trace_points_dirty_ && tp_script_compiled_ != Qnil);
+  is_updating_trace_points_ = false;
+}
+
+// The breakpoints are copied with break_point_mutex_ locked and Ruby is only
+// called once it is unlocked. Ruby may switch threads in any call, and a
+// thread waiting for the mutex would keep the GVL.
+void Server::Impl::DoUpdateTracePoints() {
+  if (is_attached_ && function_breakpoints_dirty_.exchange(false))
+    ResolveFunctionBreakPoints();
+
+  std::vector<BreakPoint> bps;
+  std::vector<BreakPoint> function_bps;
+  bool step_into_pending = false;
+  {
+    std::lock_guard<std::mutex> lock(break_point_mutex_);
+    trace_points_dirty_ = false;
+    for (const auto& line : breakpoints_) {
+      for (const auto& file : line.second) {
+        if (file.second.enabled)
+          bps.push_back(file.second);
+      }
+    }
+    std::copy_if(function_breakpoints_.cbegin(), function_breakpoints_.cend(),
+                 std::back_inserter(function_bps),
+                 [](const BreakPoint& bp) { return bp.enabled; });
+    step_into_pending = step_into_pending_;
+  }
+
+  // Disarm breakpoints which were removed or disabled. Everything is disarmed
+  // while detached and armed again when a client attaches.
+  VALUE indices = rb_funcall(breakpoint_tracepoints_, rb_intern("keys"), 0);
+  for (long i = 0; i < RARRAY_LEN(indices); ++i) {
+    size_t index = NUM2SIZET(rb_ary_entry(indices, i));
+    auto has_index = [index](const BreakPoint& bp) {
+      return bp.index == index;
+    };
+    if (!is_attached_ ||
+        (std::none_of(bps.cbegin(), bps.cend(), has_index) &&
+         std::none_of(function_bps.cbegin(), function_bps.cend(), has_index)))
+      DisarmBreakPoint(index);
+  }
+  UpdateStepInto(step_into_pending);
+  UpdateCatchPoints();
+  UpdateAllocationPoints();
+  UpdateWatchPoints();
+  UpdateRunTo();
+  if (!is_attached_) {
+    SetTraceEvents(0);
+    DisarmStepTracePoints();
+    return;
+  }
+  if (traced_threads_dirty_) {
+    SetTraceEvents(0);
+    UpdateTracedThreads();
+    DisarmCFunctionBreakPoints();
+  }
+  if (path_filter_dirty_)
+    UpdatePathFilter();
+
+  // Arm new breakpoints. Breakpoints in files which were loaded before the
+  // debugger started have no known instruction sequence, so they can only be
+  // caught by the line hook.
+  bool has_untargeted_breakpoints = false;
+  script_files_.ClearBreakPoints();
+  for (const auto& bp : bps) {
+    script_files_.Intern(bp.file).SetBreakPoint(bp.line);
+    if (rb_hash_lookup(breakpoint_tracepoints_, SIZET2NUM(bp.index)) != Qnil)
+      continue;
+    auto iseq_it = script_iseqs_.find(bp.file);
+    if (iseq_it != script_iseqs_.end()) {
+      ArmBreakPoint(bp, iseq_it->second);
+    } else {
+      has_untargeted_breakpoints = true;
+    }
+  }
+
+  // Function breakpoints never need the line hook.
+  function_names_.clear();
+  for (const auto& bp : function_bps) {
+    size_t sep = bp.method.find_last_of("#.");
+    FunctionName name;
+    name.index = bp.index;
+    name.owner = bp.method.substr(0, sep);
+    name.is_singleton = bp.method[sep] == '.';
+    function_names_.insert(std::make_pair(
+        rb_intern(bp.method.c_str() + sep + 1), name));
+    VALUE index_val = SIZET2NUM(bp.index);
+    VALUE method = rb_hash_lookup(function_methods_, index_val);
+    if (method == Qnil)
+      continue;
+    if (rb_hash_lookup(breakpoint_tracepoints_, index_val) != Qnil) {
+      // Armed again when the latency threshold was changed, since the return
+      // event is only traced for latency breakpoints.
+      auto armed = std::find_if(armed_functions_.cbegin(),
+                                armed_functions_.cend(),
+                                [&bp](const ArmedFunction& function) {
+                                  return function.index == bp.index;
+                                });
+      if (armed == armed_functions_.cend() ||
+          armed->latency == std::chrono::milliseconds(bp.latency_ms))
+        continue;
+      DisarmBreakPoint(bp.index);
+      rb_hash_aset(function_methods_, index_val, method);
+    }
+    ArmFunctionBreakPoint(bp, method);
+  }
+
+  // With a path filter, steps only trace the code of the files which are not
+  // excluded. Code without a known instruction sequence would not be traced
+  // at all, so untargeted breakpoints still need the global hooks.
+  bool is_stepping = IsSteppingPending();
+  if (is_stepping && !path_filter_.empty() && !has_untargeted_breakpoints) {
+    ArmStepTracePoints();
+  } else {
+    DisarmStepTracePoints();
+  }
+
+  rb_event_flag_t events = 0;
+  if (is_stepping && !is_step_targeted_) {
+    events = kStepEvents;
+  } else if (has_untargeted_breakpoints) {
+    events = RUBY_EVENT_LINE;
+  }
+  SetTraceEvents(events);
+}
+
+// Arms or disarms the run-to tracepoint. A run-to is dropped when the client
+// detaches.
+void Server::Impl::UpdateRunTo() {
+  if (run_to_tracepoint_ != Qnil) {
+    rb_tracepoint_disable(run_to_tracepoint_);
+    run_to_tracepoint_ = Qnil;
+  }
+  std::string file;
+  size_t line = 0;
+  {
+    std::lock_guard<std::mutex> lock(break_point_mutex_);
+    if (!is_attached_)
+      run_to_pending_ = false;
+    if (!run_to_pending_)
+      return;
+    file = run_to_file_;
+    line = run_to_line_;
+  }
+
+  auto iseq_it = script_iseqs_.find(file);
+  VALUE tp = rb_tracepoint_new(Qnil, RUBY_EVENT_LINE, &RunToEvent, this);
+  if (iseq_it != script_iseqs_.end() &&
+      EnableTracePointForTarget(tp, iseq_it->second, line)) {
+    run_to_tracepoint_ = tp;
+  } else {
+    LOG(FMT("Cannot run to " << file << ':' << line));
+    std::lock_guard<std::mutex> lock(break_point_mutex_);
+    run_to_pending_ = false;
+  }
+}
+
+// Arms the tracepoint of a new step-into command, or disarms it once the
+// command ended.
+void Server::Impl::UpdateStepInto(bool pending) {
+  if (step_into_tracepoint_ != Qnil &&
+      (!pending || step_into_method_ != Qnil)) {
+    rb_tracepoint_disable(step_into_tracepoint_);
+    step_into_tracepoint_ = Qnil;
+  }
+  if (!pending) {
+    step_into_method_ = Qnil;
+    step_into_thread_ = Qnil;
+    return;
+  }
+  if (step_into_method_ == Qnil)
+    return;
+
+  VALUE tp = rb_tracepoint_new(Qnil, RUBY_EVENT_CALL, &StepIntoEvent, this);
+  if (EnableTracePointForTarget(tp, step_into_method_, 0)) {
+    step_into_tracepoint_ = tp;
+  } else {
+    LOG("Cannot step into the method, it has no code to trace.");
+  }
+  step_into_method_ = Qnil;
+}
+
+// Compiles the filter rules and reevaluates the files seen so far.
+void Server::Impl::UpdatePathFilter() {
+  path_filter_dirty_ = false;
+  std::vector<std::pair<std::string, PathFilter::Rule>> rules;
+  {
+    std::lock_guard<std::mutex> lock(break_point_mutex_);
+    if (path_filter_enabled_)
+      rules = path_filter_rules_;
+  }
+  DisarmStepTracePoints();
+  path_filter_.Clear();
+  for (const auto& rule : rules) {
+    path_filter_.Add(rule.first, rule.second);
+  }
+  for (size_t id = 0; id < script_files_.size(); ++id) {
+    ScriptFile* file = script_files_.Get(id);
+    file->excluded = path_filter_.IsExcluded(file->path);
+  }
+}
+
+void Server::Impl::ArmStepTracePoints() {
+  if (is_step_targeted_)
+    return;
+  is_step_targeted_ = true;
+  for (auto it = script_iseqs_.cbegin(), ite = script_iseqs_.cend();
+       it != ite; ++it) {
+    if (!path_filter_.IsExcluded(it->first))
+      ArmStepTracePoint(it->second);
+  }
+}
+
+void Server::Impl::ArmStepTracePoint(VALUE iseq) {
+  VALUE tp = rb_tracepoint_new(Qnil, kStepEvents, &StepEvent, this);
+  if (EnableTracePointForTarget(tp, iseq, 0))
+    rb_ary_push(step_tracepoints_, tp);
+}
+
+void Server::Impl::DisarmStepTracePoints() {
+  if (!is_step_targeted_)
+    return;
+  is_step_targeted_ = false;
+  for (long i = 0; i < RARRAY_LEN(step_tracepoints_); ++i) {
+    rb_tracepoint_disable(rb_ary_entry(step_tracepoints_, i));
+  }
+  rb_ary_clear(step_tracepoints_);
+}
+
+// Schedules UpdateTracePoints() on the dispatch thread. Can be called from any
+// thread.
+void Server::Impl::RequestTracePointUpdate() {
+  trace_points_dirty_ = true;
+  WakeDispatchThread();
+}
+
+void Server::Impl::RequestPause() {
+  pause_requested_ = true;
+  WakeDispatchThread();
+}
+
+// Suspends at the next line run by Ruby. Line events stay enabled only until
+// that line is reached, DoBreak() then restores the previous event mask.
+void Server::Impl::ArmPause() {
+  break_at_next_line_ = true;
+  // The step tracepoints are armed if a step is still pending.
+  if (!is_step_targeted_)
+    SetTraceEvents(trace_events_ | RUBY_EVENT_LINE);
+  // Hand the GVL back right away so the running thread reaches its next line.
+  rb_thread_schedule();
+}
+
+void Server::Impl::WakeDispatchThread() {
+  std::lock_guard<std::mutex> lock(dispatch_mutex_);
+  dispatch_pending_ = true;
+  dispatch_cond_.notify_one();
+}
+
+void* Server::Impl::WaitForDispatch(void* data) {
+  Server::Impl* server = reinterpret_cast<Server::Impl*>(data);
+  std::unique_lock<std::mutex> lock(server->dispatch_mutex_);
+  server->dispatch_cond_.wait(lock, [server]() {
+    return server->dispatch_pending_;
+  });
+  server->dispatch_pending_ = false;
+  return nullptr;
+}
+
+void Server::Impl::UnblockDispatch(void* data) {
+  Server::Impl* server = reinterpret_cast<Server::Impl*>(data);
+  std::lock_guard<std::mutex> lock(server->dispatch_mutex_);
+  server->dispatch_pending_ = true;
+  server->dispatch_cond_.notify_one();
+}
+
+// The UI threads cannot call into Ruby. This Ruby thread sleeps without the
+// GVL and applies the tracepoint changes they request while Ruby is running.
+VALUE Server::Impl::DispatchThreadFunc(void* data) {
+  Server::Impl* server = reinterpret_cast<Server::Impl*>(data);
+  while (true) {
+    rb_thread_call_without_gvl(&WaitForDispatch, server, &UnblockDispatch,
+                               server);
+    if (server->is_dispatch_stopped_)
+      break;
+    if (server->trace_points_dirty_)
+      server->UpdateTracePoints();
+    if (server->pause_requested_.exchange(false))
+      server->ArmPause();
+  }
+  return Qnil;
+}
+
+void Server::Impl::StartDispatchThread() {
+  dispatch_thread_ = rb_thread_create(&DispatchThreadFunc, this);
+  rb_funcall(dispatch_thread_, rb_intern("name="), 1,
+             GetRubyInterface("SketchUp Ruby Debugger"));
+}
+
+// Wakes the dispatch thread so that it returns, and joins it. Thread#join
+// releases the GVL while waiting.
+void Server::Impl::StopDispatchThread() {
+  if (dispatch_thread_ == Qnil)
+    return;
+  is_dispatch_stopped_ = true;
+  WakeDispatchThread();
+  rb_funcall(dispatch_thread_, rb_intern("join"), 0);
+  dispatch_thread_ = Qnil;
+}
+
+BreakPoint* Server::Impl::GetBreakPoint(const std::string& file, size_t line) {
+  BreakPoint* bp = nullptr;
+  auto it = breakpoints_.find(line);
+  if (it != breakpoints_.end()) {
+    auto itf = it->second.find(file);
+    if (itf != it->second.end()) {
+      bp = &(itf->second);
+    }
+  }
+  return bp;
+}
+
+BreakPoint* Server::Impl::GetBreakPoint(size_t index) {
+  // Check resolved breakpoints
+  for (auto it = breakpoints_.begin(), ite = breakpoints_.end(); it != ite; ++it) {
+    auto& map = it->second;
+    for (auto itm = map.begin(), itme = map.end(); itm != itme; ++itm) {
+      if (itm->second.index == index) return &(itm->second);
     }
   }
 
@@ -371,200 +1918,1185 @@ BreakPoint* Server::Impl::GetBreakPoint(size_t index) {
     if (index == it->index) return &(*it);
   }
 
+  // Check function breakpoints
+  for (auto it = function_breakpoints_.begin(),
+      ite = function_breakpoints_.end(); it != ite; ++it) {
+    if (index == it->index) return &(*it);
+  }
+
   return nullptr;
 }
 
-bool Server::Impl::IsBreakPointActive(const BreakPoint &bp) {
+// Counts a hit of a breakpoint and copies it if its hit condition is met.
+// Called with break_point_mutex_ locked.
+bool Server::Impl::CountHit(BreakPoint* bp, BreakPoint& hit) {
+  if (bp == nullptr)
+    return false;
+  ++bp->hit_count;
+  if (!bp->IsHitConditionMet())
+    return false;
+  hit = *bp;
+  return true;
+}
+
+// The breakpoints are changed by the UI thread, so Ruby threads only look
+// them up with break_point_mutex_ locked, and break on a copy.
+bool Server::Impl::HitBreakPoint(const std::string& file, size_t line,
+                                 BreakPoint& hit) {
+  std::lock_guard<std::mutex> lock(break_point_mutex_);
+  return CountHit(GetBreakPoint(file, line), hit);
+}
+
+bool Server::Impl::HitBreakPoint(size_t index, BreakPoint& hit) {
+  std::lock_guard<std::mutex> lock(break_point_mutex_);
+  return CountHit(GetBreakPoint(index), hit);
+}
+
+// Evaluates the condition in the frame of the event. Simple conditions are
+// evaluated natively, the others by a proc compiled on the first evaluation.
+// Conditions which keep raising or are too slow are quarantined. The c_call
+// event of a C method has no binding, its condition only sees the self of the
+// call.
+bool Server::Impl::IsBreakPointActive(const BreakPoint &bp,
+                                      rb_trace_arg_t* trace_arg) {
   if (!bp.enabled) return false;
   if (bp.condition.empty()) return true;
 
-  assert(!frames_.empty());
-  VALUE binding = frames_.front().binding;
-  assert(binding != Qnil);
-  VALUE condition_value = EvaluateRubyExpressionAsValue(bp.condition, binding);
-  return (condition_value == Qtrue);
+  DropStaleConditions();
+  VALUE binding = rb_tracearg_binding(trace_arg);
+  auto& compiled = compiled_conditions_[bp.index];
+  if (compiled.condition != bp.condition)
+    CompileCondition(bp, binding, compiled);
+  if (compiled.quarantined)
+    return false;
+
+  auto start = std::chrono::steady_clock::now();
+  auto result = EvaluateCondition(bp, binding, rb_tracearg_self(trace_arg),
+                                  compiled);
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  ++compiled.evaluations;
+  compiled.evaluation_time += elapsed;
+
+  if (result == NativeCondition::kError &&
+      ++compiled.errors >= kConditionMaxErrors) {
+    QuarantineCondition(bp, compiled, "raised " +
+        std::to_string(compiled.errors) + " times");
+  } else if (elapsed <= std::chrono::milliseconds(kConditionBudgetMs)) {
+    compiled.overruns = 0;
+  } else if (++compiled.overruns >= kConditionMaxOverruns) {
+    QuarantineCondition(bp, compiled, "took " + std::to_string(
+        std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count())
+        + " ms, over " + std::to_string(kConditionBudgetMs) + " ms " +
+        std::to_string(compiled.overruns) + " times in a row");
+  }
+  return result == NativeCondition::kTrue;
+}
+
+Server::Impl::CompiledCondition::Result Server::Impl::EvaluateCondition(
+    const BreakPoint& bp, VALUE binding, VALUE self,
+    CompiledCondition& compiled) {
+  auto result = compiled.native.Evaluate(binding, self);
+  if (result != NativeCondition::kUnsupported)
+    return result;
+
+  VALUE proc = rb_hash_lookup(condition_procs_, SIZET2NUM(bp.index));
+  assert(proc != Qnil);
+  int error = 0;
+  VALUE condition_value = CallCompiledExpression(proc, compiled.locals,
+                                                 binding, self, error);
+  if (error)
+    return NativeCondition::kError;
+  return condition_value == Qtrue ? NativeCondition::kTrue :
+                                    NativeCondition::kFalse;
 }
 
-void Server::Impl::SaveBreakPoints() const {
-  if (save_breakpoints_) {
-    Settings::SaveBreakPoints(breakpoints_, unresolved_breakpoints_);
+// Drops the compiled conditions and messages after breakpoints changed.
+void Server::Impl::DropStaleConditions() {
+  if (conditions_dirty_.exchange(false)) {
+    compiled_conditions_.clear();
+    rb_hash_clear(condition_procs_);
+    compiled_messages_.clear();
+    rb_hash_clear(message_procs_);
+  }
+}
+
+// Evaluates the message of a logpoint in the frame of the event and hands it
+// to the UI, which queues it without blocking.
+void Server::Impl::LogPointHit(const BreakPoint& bp,
+                               rb_trace_arg_t* trace_arg) {
+  DropStaleConditions();
+  VALUE binding = rb_tracearg_binding(trace_arg);
+  auto& compiled = compiled_messages_[bp.index];
+  if (compiled.message != bp.log_message) {
+    compiled.message = bp.log_message;
+    // The message is interpolated like a double-quoted string.
+    VALUE proc = CompileExpression("%Q{" + bp.log_message + "}", binding,
+                                   compiled.locals);
+    if (proc != Qnil) {
+      rb_hash_aset(message_procs_, SIZET2NUM(bp.index), proc);
+    } else {
+      rb_hash_delete(message_procs_, SIZET2NUM(bp.index));
+    }
+  }
+
+  VALUE proc = rb_hash_lookup(message_procs_, SIZET2NUM(bp.index));
+  if (proc == Qnil) {
+    ui_->LogPoint(bp, "(message does not compile) " + bp.log_message);
+    return;
+  }
+  int error = 0;
+  VALUE message = CallCompiledExpression(proc, compiled.locals, binding,
+                                         rb_tracearg_self(trace_arg), error);
+  std::string text = GetRubyObjectAsString(message);
+  if (error)
+    text = "(" + std::string(rb_obj_classname(message)) + ") " + text;
+  ui_->LogPoint(bp, text);
+}
+
+// Captures the stack and the locals of the innermost frames within the
+// snapshot limits, without suspending. Only max_frames locations are walked.
+// The innermost frame is the one of the event, the bindings of the frames
+// further out are only available for the whole stack at once, which is only
+// done when more than one frame of locals is asked for.
+void Server::Impl::TakeSnapshot(const BreakPoint& bp,
+                                rb_trace_arg_t* trace_arg) {
+  SnapshotLimits limits;
+  {
+    std::lock_guard<std::mutex> lock(snapshots_mutex_);
+    limits = snapshot_limits_;
+  }
+  Snapshot snapshot;
+  snapshot.bp_index = bp.index;
+  snapshot.file = bp.file;
+  snapshot.line = bp.line;
+  snapshot.thread_id = GetThreadState().id;
+
+  static ID caller_locations_id = rb_intern("caller_locations");
+  static ID path_id = rb_intern("path");
+  static ID lineno_id = rb_intern("lineno");
+  VALUE locations = ProtectFuncall(rb_mKernel, caller_locations_id, 2,
+                                   INT2FIX(0), SIZET2NUM(limits.max_frames));
+  if (RB_TYPE_P(locations, T_ARRAY)) {
+    for (long i = 0; i < RARRAY_LEN(locations); ++i) {
+      // Skipped like by GetStackFrames().
+      VALUE location = RARRAY_AREF(locations, i);
+      VALUE path_val = rb_funcall(location, path_id, 0);
+      if (path_val == Qnil)
+        continue;
+      SnapshotFrame snapshot_frame;
+      snapshot_frame.file = GetRubyString(path_val);
+      if (snapshot_frame.file == "<main>")
+        continue;
+      snapshot_frame.name = GetRubyObjectAsString(location);
+      snapshot_frame.line = FIX2INT(rb_funcall(location, lineno_id, 0));
+      snapshot.frames.push_back(snapshot_frame);
+    }
+  }
+
+  size_t local_frames = std::min(limits.max_local_frames,
+                                 snapshot.frames.size());
+  if (local_frames == 1) {
+    VALUE binding = rb_tracearg_binding(trace_arg);
+    snapshot.locals.push_back(GetSnapshotLocals(binding, limits));
+    RB_GC_GUARD(binding);
+  } else if (local_frames > 1) {
+    auto frames = GetStackFrames(local_frames);
+    // The bindings are only referenced from the heap otherwise.
+    VALUE bindings = rb_ary_new_capa(static_cast<long>(frames.size()));
+    for (const auto& frame : frames) {
+      rb_ary_push(bindings, frame.binding);
+    }
+    for (const auto& frame : frames) {
+      snapshot.locals.push_back(GetSnapshotLocals(frame.binding, limits));
+    }
+    RB_GC_GUARD(bindings);
+  }
+
+  std::lock_guard<std::mutex> lock(snapshots_mutex_);
+  snapshot.id = ++last_snapshot_id_;
+  snapshots_.push_back(std::move(snapshot));
+  while (snapshots_.size() > limits.max_snapshots) {
+    snapshots_.pop_front();
+  }
+}
+
+// Stops evaluating a condition and tells the UI why.
+void Server::Impl::QuarantineCondition(const BreakPoint& bp,
+                                       CompiledCondition& compiled,
+                                       const std::string& reason) {
+  compiled.quarantined = true;
+  {
+    std::lock_guard<std::mutex> lock(break_point_mutex_);
+    BreakPoint* quarantined = GetBreakPoint(bp.index);
+    if (quarantined != nullptr && quarantined->condition == bp.condition)
+      quarantined->condition_quarantined = true;
+  }
+  auto total_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+      compiled.evaluation_time).count();
+  LOG(FMT("Condition of breakpoint " << bp.index << " quarantined, it "
+          << reason << " (" << compiled.evaluations << " evaluations, "
+          << compiled.errors << " errors, " << total_ms << " ms): "
+          << bp.condition));
+  ui_->ConditionQuarantined(bp, reason);
+}
+
+// Compiles the condition of a breakpoint on its first evaluation, natively if
+// it is simple enough and into a proc in any case.
+void Server::Impl::CompileCondition(const BreakPoint& bp, VALUE binding,
+                                    CompiledCondition& compiled) {
+  compiled = CompiledCondition();
+  compiled.condition = bp.condition;
+  compiled.native.Compile(bp.condition);
+
+  VALUE proc = CompileExpression(bp.condition, binding, compiled.locals);
+  if (proc != Qnil) {
+    rb_hash_aset(condition_procs_, SIZET2NUM(bp.index), proc);
+  } else {
+    rb_hash_delete(condition_procs_, SIZET2NUM(bp.index));
+    QuarantineCondition(bp, compiled, "does not compile");
+  }
+}
+
+void Server::Impl::SaveBreakPoints() const {
+  if (save_breakpoints_) {
+    // Function breakpoints are saved with the unresolved ones.
+    std::vector<BreakPoint> bps(unresolved_breakpoints_);
+    bps.insert(bps.end(), function_breakpoints_.cbegin(),
+               function_breakpoints_.cend());
+    Settings::SaveBreakPoints(breakpoints_, bps);
+  }
+}
+
+void Server::Impl::LoadBreakPoints() {
+  if (save_breakpoints_) {
+    Settings::LoadBreakPoints(breakpoints_, unresolved_breakpoints_,
+                              last_breakpoint_index);
+    for (auto it = unresolved_breakpoints_.begin();
+         it != unresolved_breakpoints_.end(); ) {
+      if (!it->method.empty()) {
+        function_breakpoints_.push_back(*it);
+        it = unresolved_breakpoints_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    function_breakpoints_dirty_ = true;
+  }
+}
+
+// Returns the script file for a path VALUE reported by a tracepoint. Does not
+// allocate unless the path was evicted from the cache or was never seen.
+const ScriptFile& Server::Impl::GetScriptFile(VALUE path_val) {
+  size_t slot = (static_cast<size_t>(path_val) >> 3) % kPathCacheSize;
+  if (path_cache_keys_[slot] == path_val)
+    return *path_cache_values_[slot];
+
+  ScriptFile& file = script_files_.Intern(GetRubyString(path_val));
+  file.excluded = path_filter_.IsExcluded(file.path);
+  path_cache_keys_[slot] = path_val;
+  path_cache_values_[slot] = &file;
+  return file;
+}
+
+namespace {
+
+// The state of the thread which last ran a hook on this native thread. The
+// slot is refreshed when Ruby runs another thread on it or states were pruned.
+struct ThreadSlot {
+  VALUE thread;
+  size_t generation;
+  ThreadState* state;
+};
+
+thread_local ThreadSlot tls_thread_slot = { Qnil, 0, nullptr };
+
+} // end anonymous namespace
+
+// Returns the state of the current Ruby thread without locking, except for
+// the first event of each thread.
+ThreadState& Server::Impl::GetThreadState() {
+  VALUE thread = rb_thread_current();
+  size_t generation = thread_states_.generation();
+  ThreadSlot& slot = tls_thread_slot;
+  if (slot.thread != thread || slot.generation != generation ||
+      slot.state == nullptr) {
+    slot.state = &thread_states_.Get(NUM2SIZET(rb_obj_id(thread)));
+    slot.thread = thread;
+    slot.generation = generation;
+  }
+  return *slot.state;
+}
+
+// Takes a snapshot of the Ruby threads for the UI and drops the states of the
+// threads which ended.
+void Server::Impl::UpdateThreadList() {
+  VALUE current = rb_thread_current();
+  VALUE threads = rb_funcall(rb_cThread, rb_intern("list"), 0);
+  static const ID id_status = rb_intern("status");
+  std::vector<ThreadInfo> infos;
+  std::vector<size_t> ids;
+  for (long i = 0; i < RARRAY_LEN(threads); ++i) {
+    VALUE thread = rb_ary_entry(threads, i);
+    ThreadInfo info;
+    info.id = NUM2SIZET(rb_obj_id(thread));
+    VALUE status = rb_funcall(thread, id_status, 0);
+    info.status = RB_TYPE_P(status, T_STRING) ? GetRubyString(status) : "dead";
+    info.is_current = thread == current;
+    infos.push_back(info);
+    ids.push_back(info.id);
+  }
+  thread_states_.Prune(ids);
+
+  std::lock_guard<std::mutex> lock(threads_mutex_);
+  threads_.swap(infos);
+}
+
+static void ProcessLine(Server::Impl* server, ThreadState& state,
+                        const ScriptFile& file, int line,
+                        rb_trace_arg_t* trace_arg) {
+  // Steps and pauses do not stop in excluded files, breakpoints still do.
+  if (!file.excluded &&
+      (server->break_at_next_line_ || state.break_at_next_line ||
+       state.stop_requested ||
+       (state.stepover_break_at_next_line && state.step_depth <= 0))) {
+    // The thread may only have been traced for the step or the stop.
+    if (state.IsSteppingPending())
+      server->traced_threads_dirty_ = true;
+    server->break_at_next_line_ = false;
+    state.ClearSuspensionData();
+    server->DoBreak(file.path, line);
+  } else {
+    if (server->trace_points_dirty_)
+      server->UpdateTracePoints();
+
+    // Only look up the breakpoint when the line bitmap says there is one.
+    if (file.HasBreakPoint(line)) {
+      // Breakpoint hit. The hit condition is checked before the condition is
+      // evaluated.
+      BreakPoint bp;
+      if (server->HitBreakPoint(file.path, line, bp))
+        server->DoBreak(bp, trace_arg);
+    }
+  }
+}
+
+// Evaluates the predicate of an until command at a line of the thread which
+// gave it. A block runs in the frame it was written in, so a step over
+// evaluates it as long as the blocks entered make up for the calls entered,
+// e.g. in the body of an each or times loop, and the block belongs to the
+// method and self of the frame, not to a method it called.
+bool Server::Impl::IsUntilSatisfied(ThreadState& state,
+                                    rb_trace_arg_t* trace_arg) {
+  if (!state.until_step_into) {
+    if (state.step_depth - state.block_depth > state.block_depth)
+      return false;
+    VALUE self = rb_tracearg_self(trace_arg);
+    VALUE method_id = rb_tracearg_method_id(trace_arg);
+    if (state.step_depth == 0) {
+      if (!is_until_frame_known_) {
+        is_until_frame_known_ = true;
+        until_self_ = self;
+        until_method_id_ = method_id;
+      }
+    } else if (!is_until_frame_known_ || self != until_self_ ||
+               method_id != until_method_id_) {
+      return false;
+    }
+  }
+  if (until_proc_ == Qnil ||
+      GetScriptFile(rb_tracearg_path(trace_arg)).excluded)
+    return false;
+
+  VALUE binding = rb_tracearg_binding(trace_arg);
+  VALUE self = rb_tracearg_self(trace_arg);
+  auto result = until_native_.Evaluate(binding, self, true);
+  if (result == NativeCondition::kUnsupported) {
+    // E.g. a local variable which does not exist in this frame raises.
+    int error = 0;
+    VALUE value = CallCompiledExpression(until_proc_, until_locals_, binding,
+                                         self, error);
+    result = !error && RTEST(value) ? NativeCondition::kTrue :
+                                      NativeCondition::kFalse;
+  }
+  if (result != NativeCondition::kTrue)
+    return false;
+  until_proc_ = Qnil;
+  return true;
+}
+
+static void ProcessLine(Server::Impl* server, ThreadState& state,
+                        rb_trace_arg_t* trace_arg) {
+  const ScriptFile& file = server->GetScriptFile(rb_tracearg_path(trace_arg));
+  int line = FIX2INT(rb_tracearg_lineno(trace_arg));
+  ProcessLine(server, state, file, line, trace_arg);
+}
+
+// Handles the line, call and return events of tp_events_ and of the step
+// tracepoints.
+static void ProcessEvent(Server::Impl* server, rb_trace_arg_t* trace_arg) {
+  ThreadState& state = server->GetThreadState();
+
+  rb_event_flag_t event = rb_tracearg_event_flag(trace_arg);
+  switch (event) {
+    case RUBY_EVENT_LINE:
+      if (state.until_pending && server->IsUntilSatisfied(state, trace_arg))
+        state.break_at_next_line = true;
+      ProcessLine(server, state, trace_arg);
+      break;
+    case RUBY_EVENT_CALL:
+    case RUBY_EVENT_B_CALL:
+    case RUBY_EVENT_CLASS:
+      ++state.step_depth;
+      if (event == RUBY_EVENT_B_CALL)
+        ++state.block_depth;
+      ProcessLine(server, state, trace_arg);
+      break;
+    case RUBY_EVENT_RETURN:
+    case RUBY_EVENT_B_RETURN:
+    case RUBY_EVENT_END:
+      ProcessLine(server, state, trace_arg);
+      --state.step_depth;
+      if (event == RUBY_EVENT_B_RETURN && state.block_depth > 0)
+        --state.block_depth;
+      // Until steps over calls of the frame it was given in, and continues in
+      // the caller when that frame returns.
+      if (state.until_pending && !state.until_step_into &&
+          state.step_depth < 0) {
+        state.step_depth = 0;
+        state.block_depth = 0;
+        server->is_until_frame_known_ = false;
+      }
+      // Stepped out of the frame, stop at the next line of this thread
+      // wherever it is.
+      if (state.stepout_break_at_next_line && state.step_depth < 0) {
+        state.stepout_break_at_next_line = false;
+        state.break_at_next_line = true;
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+void Server::Impl::TraceEvent(VALUE tp_val, void* data) {
+  Server::Impl* server = reinterpret_cast<Server::Impl*>(data);
+  // The debugger's own thread is never traced.
+  if (rb_thread_current() == server->dispatch_thread_)
+    return;
+  ProcessEvent(server, rb_tracearg_from_tracepoint(tp_val));
+}
+
+// Called for the run-to tracepoint.
+void Server::Impl::RunToEvent(VALUE tp_val, void* data) {
+  Server::Impl* server = reinterpret_cast<Server::Impl*>(data);
+  if (!server->IsTracedThread(rb_thread_current()))
+    return;
+
+  // One-shot, DoBreak() does not rearm it.
+  rb_tracepoint_disable(tp_val);
+  rb_trace_arg_t* trace_arg = rb_tracearg_from_tracepoint(tp_val);
+  const ScriptFile& file = server->GetScriptFile(rb_tracearg_path(trace_arg));
+  server->break_at_next_line_ = false;
+  server->GetThreadState().ClearSuspensionData();
+  server->DoBreak(file.path, FIX2INT(rb_tracearg_lineno(trace_arg)));
+}
+
+// Called when the method of a step-into command is called.
+void Server::Impl::StepIntoEvent(VALUE tp_val, void* data) {
+  Server::Impl* server = reinterpret_cast<Server::Impl*>(data);
+  if (rb_thread_current() != server->step_into_thread_)
+    return;
+
+  rb_tracepoint_disable(tp_val);
+  rb_trace_arg_t* trace_arg = rb_tracearg_from_tracepoint(tp_val);
+  const ScriptFile& file = server->GetScriptFile(rb_tracearg_path(trace_arg));
+  server->break_at_next_line_ = false;
+  server->GetThreadState().ClearSuspensionData();
+  server->DoBreak(file.path, FIX2INT(rb_tracearg_lineno(trace_arg)));
+}
+
+// Called when an exception is raised while there are catch points. Raises of
+// other classes are rejected by a single hash lookup.
+void Server::Impl::RaiseEvent(VALUE tp_val, void* data) {
+  Server::Impl* server = reinterpret_cast<Server::Impl*>(data);
+  rb_trace_arg_t* trace_arg = rb_tracearg_from_tracepoint(tp_val);
+  VALUE exception = rb_tracearg_raised_exception(trace_arg);
+  if (!server->IsCaught(rb_obj_class(exception)))
+    return;
+  if (!server->IsTracedThread(rb_thread_current()))
+    return;
+  VALUE path = rb_tracearg_path(trace_arg);
+  if (path == Qnil)
+    return;
+
+  const ScriptFile& file = server->GetScriptFile(path);
+  server->break_at_next_line_ = false;
+  server->GetThreadState().ClearSuspensionData();
+  server->DoBreak(file.path, FIX2INT(rb_tracearg_lineno(trace_arg)),
+                  exception);
+}
+
+// Returns true if exceptions of the given class are caught. The ancestors of
+// each raised class are only compared with the catch points once. They are
+// compared by name, so that classes defined or reloaded after the catch point
+// was set are caught as well.
+bool Server::Impl::IsCaught(VALUE klass) {
+  VALUE caught = rb_hash_lookup2(catch_classes_, klass, Qundef);
+  if (caught != Qundef)
+    return caught == Qtrue;
+
+  caught = Qfalse;
+  VALUE ancestors = rb_mod_ancestors(klass);
+  for (long i = 0; i < RARRAY_LEN(ancestors) && caught == Qfalse; ++i) {
+    VALUE name = rb_mod_name(RARRAY_AREF(ancestors, i));
+    if (name == Qnil)
+      continue;
+    std::string class_name(RSTRING_PTR(name), RSTRING_LEN(name));
+    if (std::find(catch_names_.cbegin(), catch_names_.cend(), class_name) !=
+        catch_names_.cend())
+      caught = Qtrue;
+  }
+  // Anonymous classes raised once would accumulate otherwise.
+  if (RHASH_SIZE(catch_classes_) >= kMaxCatchClasses)
+    rb_hash_clear(catch_classes_);
+  rb_hash_aset(catch_classes_, klass, caught);
+  return caught == Qtrue;
+}
+
+// Enables the raise hook while a client is attached and there are catch
+// points.
+void Server::Impl::UpdateCatchPoints() {
+  if (catch_points_dirty_.exchange(false)) {
+    {
+      std::lock_guard<std::mutex> lock(break_point_mutex_);
+      catch_names_ = catch_points_;
+    }
+    rb_hash_clear(catch_classes_);
+  }
+  bool enable = is_attached_ && !catch_names_.empty();
+  if (enable != RTEST(rb_tracepoint_enabled_p(tp_raise_))) {
+    if (enable) {
+      rb_tracepoint_enable(tp_raise_);
+    } else {
+      rb_tracepoint_disable(tp_raise_);
+    }
+  }
+}
+
+// Called for the line, call and return events of the scripts with an
+// allocation point. Compares the number of objects allocated since the
+// previous line of the frame with the limit, without calling any Ruby code.
+void Server::Impl::AllocationEvent(VALUE tp_val, void* data) {
+  Server::Impl* server = reinterpret_cast<Server::Impl*>(data);
+  if (!server->IsTracedThread(rb_thread_current()))
+    return;
+  static VALUE total_allocated_objects_sym =
+      ID2SYM(rb_intern("total_allocated_objects"));
+  size_t allocated = rb_gc_stat(total_allocated_objects_sym);
+
+  ThreadState& state = server->GetThreadState();
+  if (state.allocation_generation != server->allocation_generation_) {
+    state.allocation_generation = server->allocation_generation_;
+    state.allocation_depth = 0;
+    state.allocation_overflow = 0;
+  }
+  rb_trace_arg_t* trace_arg = rb_tracearg_from_tracepoint(tp_val);
+  rb_event_flag_t event = rb_tracearg_event_flag(trace_arg);
+  if (event & kAllocationFrameBeginEvents) {
+    if (state.allocation_depth == ThreadState::kMaxAllocationFrames) {
+      ++state.allocation_overflow;
+    } else {
+      auto& frame = state.allocation_frames[state.allocation_depth++];
+      frame.allocated = allocated;
+      frame.line = 0;
+    }
+    return;
+  }
+  if (event & kAllocationFrameEndEvents) {
+    if (state.allocation_overflow != 0) {
+      --state.allocation_overflow;
+    } else if (state.allocation_depth != 0) {
+      --state.allocation_depth;
+    }
+    return;
+  }
+
+  // Lines of frames nested deeper than the stack are not checked. A line
+  // without a known frame, e.g. at the top level of a script, starts one.
+  if (state.allocation_overflow != 0)
+    return;
+  if (state.allocation_depth == 0) {
+    state.allocation_frames[0].line = 0;
+    state.allocation_depth = 1;
+  }
+  auto& frame = state.allocation_frames[state.allocation_depth - 1];
+  size_t count = allocated - frame.allocated;
+  int previous_line = frame.line;
+  int line = FIX2INT(rb_tracearg_lineno(trace_arg));
+  frame.allocated = allocated;
+  frame.line = line;
+  if (previous_line == 0)
+    return;
+  auto it = std::find_if(server->armed_allocations_.cbegin(),
+                         server->armed_allocations_.cend(),
+                         [tp_val](const ArmedAllocation& armed) {
+                           return armed.tracepoint == tp_val;
+                         });
+  if (it == server->armed_allocations_.cend() || count <= it->max_objects)
+    return;
+
+  const ScriptFile& file = server->GetScriptFile(rb_tracearg_path(trace_arg));
+  LOG(FMT(file.path << ':' << previous_line << " allocated " << count
+          << " objects"));
+  server->break_at_next_line_ = false;
+  state.ClearSuspensionData();
+  server->DoBreak(file.path, line);
+
+  // The objects allocated by the debugger while suspended are not counted.
+  ThreadState& resumed = server->GetThreadState();
+  if (resumed.allocation_generation == server->allocation_generation_ &&
+      resumed.allocation_depth != 0 && resumed.allocation_overflow == 0) {
+    resumed.allocation_frames[resumed.allocation_depth - 1].allocated =
+        rb_gc_stat(total_allocated_objects_sym);
+  }
+}
+
+// Arms a tracepoint targeted at each loaded script which matches an
+// allocation point, while a client is attached.
+void Server::Impl::UpdateAllocationPoints() {
+  std::vector<AllocationPoint> points;
+  {
+    std::lock_guard<std::mutex> lock(break_point_mutex_);
+    points = allocation_points_;
+  }
+  bool arm = is_attached_ && !points.empty();
+  if (!allocation_points_dirty_.exchange(false) &&
+      arm == are_allocation_points_armed_)
+    return;
+
+  for (long i = 0; i < RARRAY_LEN(allocation_tracepoints_); ++i) {
+    rb_tracepoint_disable(rb_ary_entry(allocation_tracepoints_, i));
+  }
+  rb_ary_clear(allocation_tracepoints_);
+  armed_allocations_.clear();
+  ++allocation_generation_;
+  are_allocation_points_armed_ = arm;
+  if (!arm)
+    return;
+
+  // A script which matches several allocation points is traced once, with
+  // the lowest limit.
+  for (auto it = script_iseqs_.cbegin(), ite = script_iseqs_.cend(); it != ite;
+       ++it) {
+    bool matched = false;
+    size_t max_objects = std::numeric_limits<size_t>::max();
+    for (const auto& point : points) {
+      if (FindSubstringCaseInsensitive(it->first, point.file) >= 0) {
+        matched = true;
+        max_objects = std::min(max_objects, point.max_objects);
+      }
+    }
+    if (!matched)
+      continue;
+    VALUE tp = rb_tracepoint_new(Qnil, kAllocationEvents, &AllocationEvent,
+                                 this);
+    if (EnableTracePointForTarget(tp, it->second, 0)) {
+      rb_ary_push(allocation_tracepoints_, tp);
+      ArmedAllocation armed;
+      armed.tracepoint = tp;
+      armed.max_objects = max_objects;
+      armed_allocations_.push_back(armed);
+    }
+  }
+}
+
+// Called for the lines and returns of the methods of the watched classes.
+// The variable is read with rb_ivar_get and compared by identity, and only
+// for the watched object itself.
+void Server::Impl::WatchEvent(VALUE tp_val, void* data) {
+  Server::Impl* server = reinterpret_cast<Server::Impl*>(data);
+  rb_trace_arg_t* trace_arg = rb_tracearg_from_tracepoint(tp_val);
+  VALUE self = rb_tracearg_self(trace_arg);
+  for (const auto& watch : server->armed_watches_) {
+    if (RARRAY_AREF(watch.entry, 0) != self)
+      continue;
+    // A change made by another thread is seen by the next traced event.
+    if (!server->IsTracedThread(rb_thread_current()))
+      return;
+    VALUE value = rb_ivar_get(self, watch.ivar_id);
+    if (value == RARRAY_AREF(watch.entry, 1))
+      continue;
+    rb_ary_store(watch.entry, 1, value);
+
+    // The variable was changed by the previous line, or by a call made there.
+    const ScriptFile& file =
+        server->GetScriptFile(rb_tracearg_path(trace_arg));
+    LOG(FMT("Watch point " << watch.index << ": " << rb_id2name(watch.ivar_id)
+            << " changed to " << GetRubyObjectAsString(value)));
+    server->break_at_next_line_ = false;
+    server->GetThreadState().ClearSuspensionData();
+    server->DoBreak(file.path, FIX2INT(rb_tracearg_lineno(trace_arg)));
+    // DoBreak() may have armed the watch points again.
+    return;
+  }
+}
+
+// Arms the tracepoints of the watch points while a client is attached.
+void Server::Impl::UpdateWatchPoints() {
+  std::vector<WatchPoint> watch_points;
+  {
+    std::lock_guard<std::mutex> lock(break_point_mutex_);
+    watch_points = watch_points_;
+  }
+  bool arm = is_attached_ && !watch_points.empty();
+  if (!watch_points_dirty_.exchange(false) && arm == are_watch_points_armed_)
+    return;
+
+  for (long i = 0; i < RARRAY_LEN(watch_tracepoints_); ++i) {
+    rb_tracepoint_disable(rb_ary_entry(watch_tracepoints_, i));
+  }
+  rb_ary_clear(watch_tracepoints_);
+  armed_watches_.clear();
+  are_watch_points_armed_ = arm;
+
+  // Let go of the objects of removed watch points.
+  VALUE indices = rb_funcall(watch_objects_, rb_intern("keys"), 0);
+  for (long i = 0; i < RARRAY_LEN(indices); ++i) {
+    size_t index = NUM2SIZET(rb_ary_entry(indices, i));
+    if (std::none_of(watch_points.cbegin(), watch_points.cend(),
+                     [index](const WatchPoint& watch) {
+                       return watch.index == index;
+                     }))
+      rb_hash_delete(watch_objects_, rb_ary_entry(indices, i));
+  }
+  if (!arm)
+    return;
+
+  // Methods which are defined later are armed when they are.
+  HookMethodAdded();
+  // Watch points on objects of the same class share the tracepoints.
+  std::set<VALUE> classes;
+  for (const auto& watch : watch_points) {
+    VALUE entry = rb_hash_lookup(watch_objects_, SIZET2NUM(watch.index));
+    if (entry == Qnil)
+      continue;
+    ArmedWatch armed;
+    armed.index = watch.index;
+    armed.entry = entry;
+    armed.ivar_id = rb_intern(watch.ivar.c_str());
+    armed_watches_.push_back(armed);
+    VALUE klass = CLASS_OF(RARRAY_AREF(entry, 0));
+    if (classes.insert(klass).second)
+      ArmWatchedClass(klass);
+  }
+}
+
+// Arms a line and return tracepoint targeted at each Ruby method of the class
+// and of its ancestors up to Object, so that no other code is traced. Methods
+// defined in C, such as attribute writers, cannot be targeted.
+void Server::Impl::ArmWatchedClass(VALUE klass) {
+  static ID instance_methods_id = rb_intern("instance_methods");
+  static ID private_instance_methods_id =
+      rb_intern("private_instance_methods");
+  static ID instance_method_id = rb_intern("instance_method");
+  VALUE ancestors = rb_mod_ancestors(klass);
+  for (long i = 0; i < RARRAY_LEN(ancestors); ++i) {
+    VALUE module = RARRAY_AREF(ancestors, i);
+    if (module == rb_cObject)
+      break;
+    VALUE names = rb_ary_plus(
+        rb_funcall(module, instance_methods_id, 1, Qfalse),
+        rb_funcall(module, private_instance_methods_id, 1, Qfalse));
+    for (long j = 0; j < RARRAY_LEN(names); ++j) {
+      VALUE method = ProtectFuncall(module, instance_method_id, 1,
+                                    RARRAY_AREF(names, j));
+      if (!RTEST(rb_obj_is_kind_of(method, rb_cUnboundMethod)))
+        continue;
+      VALUE tp = rb_tracepoint_new(Qnil, RUBY_EVENT_LINE | RUBY_EVENT_RETURN,
+                                   &WatchEvent, this);
+      if (EnableTracePointForTarget(tp, method, 0))
+        rb_ary_push(watch_tracepoints_, tp);
+    }
+  }
+}
+
+// Arms a line and return tracepoint targeted at a method which was just
+// defined in a module, when the class of a watched object is or includes it.
+void Server::Impl::ArmWatchedMethod(VALUE module, VALUE name) {
+  // ArmWatchedClass() leaves out Object and its ancestors.
+  if (RTEST(rb_class_inherited_p(rb_cObject, module)))
+    return;
+  bool is_watched = false;
+  for (const auto& watch : armed_watches_) {
+    VALUE klass = CLASS_OF(RARRAY_AREF(watch.entry, 0));
+    if (RTEST(rb_class_inherited_p(klass, module))) {
+      is_watched = true;
+      break;
+    }
+  }
+  if (!is_watched)
+    return;
+  static ID instance_method_id = rb_intern("instance_method");
+  VALUE method = ProtectFuncall(module, instance_method_id, 1, name);
+  if (!RTEST(rb_obj_is_kind_of(method, rb_cUnboundMethod)))
+    return;
+  VALUE tp = rb_tracepoint_new(Qnil, RUBY_EVENT_LINE | RUBY_EVENT_RETURN,
+                               &WatchEvent, this);
+  if (EnableTracePointForTarget(tp, method, 0))
+    rb_ary_push(watch_tracepoints_, tp);
+}
+
+// Called for the step tracepoints, which are targeted at code, not at
+// threads.
+void Server::Impl::StepEvent(VALUE tp_val, void* data) {
+  Server::Impl* server = reinterpret_cast<Server::Impl*>(data);
+  if (!server->IsTracedThread(rb_thread_current()))
+    return;
+  ProcessEvent(server, rb_tracearg_from_tracepoint(tp_val));
+}
+
+// Called for the targeted line tracepoints of the breakpoints, and for the
+// call tracepoints of the breakpoints on the line of a def.
+void Server::Impl::BreakPointEvent(VALUE tp_val, void* data) {
+  Server::Impl* server = reinterpret_cast<Server::Impl*>(data);
+  // Breakpoint tracepoints are targeted at code, not at threads.
+  if (!server->IsTracedThread(rb_thread_current()))
+    return;
+  rb_trace_arg_t* trace_arg = rb_tracearg_from_tracepoint(tp_val);
+  // The line hook processes this event as well when it is enabled for it.
+  if (server->trace_events_ & rb_tracearg_event_flag(trace_arg))
+    return;
+
+  const ScriptFile& file = server->GetScriptFile(rb_tracearg_path(trace_arg));
+  // So do the step tracepoints while armed for this file.
+  if (server->is_step_targeted_ && !file.excluded)
+    return;
+
+  ProcessLine(server, server->GetThreadState(), file,
+              FIX2INT(rb_tracearg_lineno(trace_arg)), trace_arg);
+}
+
+// Called for the call and c_call tracepoints of the function breakpoints, and
+// for their return events while timing calls. A latency breakpoint pushes the
+// start of each call on a fixed-size stack of the thread, and is only hit
+// when the call returns after its threshold.
+void Server::Impl::FunctionBreakPointEvent(VALUE tp_val, void* data) {
+  Server::Impl* server = reinterpret_cast<Server::Impl*>(data);
+  rb_trace_arg_t* trace_arg = rb_tracearg_from_tracepoint(tp_val);
+  auto it = std::find_if(server->armed_functions_.cbegin(),
+                         server->armed_functions_.cend(),
+                         [tp_val](const ArmedFunction& function) {
+                           return function.tracepoint == tp_val;
+                         });
+  if (it == server->armed_functions_.cend() ||
+      SYM2ID(rb_tracearg_method_id(trace_arg)) != it->method_id ||
+      rb_tracearg_defined_class(trace_arg) != it->owner)
+    return;
+  if (it->latency == std::chrono::steady_clock::duration::zero()) {
+    server->FunctionBreakPointHit(it->index, trace_arg);
+    return;
+  }
+
+  ThreadState& state = server->GetThreadState();
+  rb_event_flag_t event = rb_tracearg_event_flag(trace_arg);
+  if (event & (RUBY_EVENT_CALL | RUBY_EVENT_C_CALL)) {
+    if (state.latency_depth == ThreadState::kMaxLatencyFrames) {
+      ++state.latency_overflow;
+    } else {
+      auto& frame = state.latency_frames[state.latency_depth++];
+      frame.index = it->index;
+      frame.start = std::chrono::steady_clock::now();
+    }
+    return;
+  }
+
+  // The innermost calls return first. A return without a timed call, e.g.
+  // when armed during the call, is ignored.
+  if (state.latency_overflow != 0) {
+    --state.latency_overflow;
+    return;
   }
+  size_t depth = state.latency_depth;
+  while (depth != 0 && state.latency_frames[depth - 1].index != it->index)
+    --depth;
+  if (depth == 0)
+    return;
+  state.latency_depth = depth - 1;
+  auto elapsed = std::chrono::steady_clock::now() -
+                 state.latency_frames[depth - 1].start;
+  if (elapsed <= it->latency)
+    return;
+  LOG(FMT("Call of breakpoint " << it->index << " took "
+          << std::chrono::duration_cast<std::chrono::milliseconds>(
+                 elapsed).count() << " ms"));
+  server->FunctionBreakPointHit(it->index, trace_arg);
 }
 
-void Server::Impl::LoadBreakPoints() {
-  if (save_breakpoints_) {
-    Settings::LoadBreakPoints(breakpoints_, unresolved_breakpoints_,
-                              last_breakpoint_index);
+// Breaks, logs or takes a snapshot for a hit of a function breakpoint.
+void Server::Impl::FunctionBreakPointHit(size_t index,
+                                         rb_trace_arg_t* trace_arg) {
+  if (!IsTracedThread(rb_thread_current()))
+    return;
+  BreakPoint hit;
+  if (!HitBreakPoint(index, hit))
+    return;
+
+  // The breakpoint stops at the method's first line, or at the caller's line
+  // for a C method. A latency breakpoint stops where the method returns.
+  VALUE path = rb_tracearg_path(trace_arg);
+  if (path != Qnil) {
+    hit.file = GetScriptFile(path).path;
+    hit.line = FIX2INT(rb_tracearg_lineno(trace_arg));
   }
+  DoBreak(hit, trace_arg);
 }
 
-#define EVENT_COMMON_CODE \
-  rb_trace_arg_t* trace_arg = rb_tracearg_from_tracepoint(tp_val);\
-  Server::Impl* server = reinterpret_cast<Server::Impl*>(data);\
-  server->ClearBreakData();\
-  std::string file_path = GetRubyString(rb_tracearg_path(trace_arg));\
-  int line = GetRubyInt(rb_tracearg_lineno(trace_arg));\
-  VALUE event_sym = rb_tracearg_event(trace_arg);\
-//   Log(("\n*** Debugger event: " +\
-//       GetRubyString(rb_sym_to_s(event_sym)) + ", " + file_path.c_str() + ":" +\
-//       boost::lexical_cast<std::string>(line).c_str() + "\n").c_str())
-
-static void ProcessLine(Server::Impl* server, const std::string& file_path,
-                        int line) {
-  if (server->call_depth_ == 0)
-    server->call_depth_ = 1;
-
-  if (server->break_at_next_line_ ||
-      (server->stepover_break_at_next_line_ &&
-       server->stepover_to_call_depth_ >= server->call_depth_) ||
-      (server->stepout_break_at_next_line_)) {
-    server->ClearSuspensionData();
-    server->DoBreak(file_path, line);
-  } else {
-    // Try to resolve any unresolved breakpoints
+// Records the instruction sequence of each loaded script so that breakpoints
+// in it can be armed as targeted tracepoints, and resolves the breakpoints
+// which match the newly loaded file.
+void Server::Impl::ScriptCompiledEvent(VALUE tp_val, void* data) {
+  Server::Impl* server = reinterpret_cast<Server::Impl*>(data);
+
+  // Skip code compiled by eval.
+  static const ID id_eval_script = rb_intern("eval_script");
+  if (rb_funcall(tp_val, id_eval_script, 0) != Qnil)
+    return;
+
+  static const ID id_instruction_sequence = rb_intern("instruction_sequence");
+  VALUE iseq = rb_funcall(tp_val, id_instruction_sequence, 0);
+  if (iseq == Qnil)
+    return;
+  static const ID id_path = rb_intern("path");
+  std::string file_path = GetRubyString(rb_funcall(iseq, id_path, 0));
+
+  server->ReadScriptLines(file_path);
+  std::vector<BreakPoint> bps;
+  {
+    std::lock_guard<std::mutex> lock(server->break_point_mutex_);
+    auto it = server->script_iseqs_.find(file_path);
+    if (it == server->script_iseqs_.end()) {
+      it = server->script_iseqs_.insert(std::make_pair(file_path, Qnil)).first;
+      rb_gc_register_address(&it->second);
+    }
+    it->second = iseq;
+
+    if (!server->allocation_points_.empty())
+      server->allocation_points_dirty_ = true;
     if (!server->unresolved_breakpoints_.empty())
-      server->ResolveBreakPoints();
+      server->ResolveBreakPoints(file_path);
+    for (auto itl = server->breakpoints_.cbegin(),
+         itle = server->breakpoints_.cend(); itl != itle; ++itl) {
+      auto itf = itl->second.find(file_path);
+      if (itf != itl->second.end() && itf->second.enabled)
+        bps.push_back(itf->second);
+    }
+  }
 
-    auto bp = server->GetBreakPoint(file_path, line);
-    if (bp != nullptr) {
-      // Breakpoint hit
-      server->DoBreak(*bp);
+  if (server->is_step_targeted_ &&
+      !server->path_filter_.IsExcluded(file_path)) {
+    server->ArmStepTracePoint(iseq);
+  }
+  // Breakpoints armed for a previous load of this file need to be armed for
+  // the new code as well.
+  for (const auto& bp : bps) {
+    if (rb_hash_lookup(server->breakpoint_tracepoints_,
+                       SIZET2NUM(bp.index)) != Qnil) {
+      server->ArmBreakPoint(bp, iseq);
     }
   }
+  server->UpdateTracePoints();
 }
 
-void Server::Impl::LineEvent(VALUE tp_val, void* data) {
-  EVENT_COMMON_CODE;
-  (void)event_sym; // Suppress unused warning
-
-  ProcessLine(server, file_path, line);
+void* Server::Impl::WaitForSuspensionEnd(void* data) {
+  Server::Impl* server = reinterpret_cast<Server::Impl*>(data);
+  std::unique_lock<std::mutex> lock(server->suspension_mutex_);
+  server->suspension_cond_.wait(lock, [server]() {
+    return !server->is_suspending_ || server->suspension_unblocked_;
+  });
+  server->suspension_unblocked_ = false;
+  return nullptr;
 }
 
-void Server::Impl::ReturnEvent(VALUE tp_val, void* data) {
-  EVENT_COMMON_CODE;
-
-  // C returns complicate things, do not process their lines.
-  static const ID id_c_return = rb_intern("c_return");
-  if (SYM2ID(event_sym) != id_c_return)
-    ProcessLine(server, file_path, line);
+void Server::Impl::UnblockSuspensionWait(void* data) {
+  Server::Impl* server = reinterpret_cast<Server::Impl*>(data);
+  std::lock_guard<std::mutex> lock(server->suspension_mutex_);
+  server->suspension_unblocked_ = true;
+  server->suspension_cond_.notify_all();
+}
 
-  if(server->call_depth_ > 0)
-    --server->call_depth_;
+// Waits without the GVL while another thread is suspended.
+void Server::Impl::BeginSuspension() {
+  while (true) {
+    {
+      std::lock_guard<std::mutex> lock(suspension_mutex_);
+      if (!is_suspending_) {
+        is_suspending_ = true;
+        break;
+      }
+    }
+    rb_thread_call_without_gvl(&WaitForSuspensionEnd, this,
+                               &UnblockSuspensionWait, this);
+  }
 
-  if (server->call_depth_ == server->stepout_to_call_depth_) {
-    server->ClearSuspensionData();
-    server->stepout_break_at_next_line_ = true;
+  // Any suspension ends a pending run-to or step-into, UpdateTracePoints()
+  // disarms them.
+  std::lock_guard<std::mutex> lock(break_point_mutex_);
+  if (run_to_pending_ || step_into_pending_) {
+    run_to_pending_ = false;
+    step_into_pending_ = false;
+    trace_points_dirty_ = true;
   }
 }
 
-void Server::Impl::CallEvent(VALUE tp_val, void* data) {
-  EVENT_COMMON_CODE;
-
-  ++server->call_depth_;
+void Server::Impl::EndSuspension() {
+  std::lock_guard<std::mutex> lock(suspension_mutex_);
+  is_suspending_ = false;
+  suspension_cond_.notify_all();
+}
 
-  // C calls complicate things, do not process their lines.
-  static const ID id_c_call = rb_intern("c_call");
-  if (SYM2ID(event_sym) != id_c_call)
-    ProcessLine(server, file_path, line);
+// The frames are only referenced from C++ while suspended, and other threads
+// may run the GC meanwhile.
+void Server::Impl::RetainFrames() {
+  for (const auto& frame : frames_) {
+    rb_ary_push(frame_values_, frame.binding);
+    rb_ary_push(frame_values_, frame.self);
+    rb_ary_push(frame_values_, frame.klass);
+  }
 }
 
 void Server::Impl::ClearSuspensionData() {
   break_at_next_line_ = false;
-  stepout_break_at_next_line_ = false;
-  stepover_break_at_next_line_ = false;
-  stepout_to_call_depth_ = -1;
-  stepover_to_call_depth_ = -1;
+  thread_states_.ClearSuspensionData();
 }
 
 // Performs necessary operations when a suspension point is hit.
-void Server::Impl::DoBreak(const std::string& file_path, size_t line) {
+void Server::Impl::DoBreak(const std::string& file_path, size_t line,
+                           VALUE exception) {
+  BeginSuspension();
   frames_ = GetStackFrames();
+  RetainFrames();
+  UpdateThreadList();
   last_break_file_path_ = file_path;
   last_break_line_ = line;
+  suspended_thread_id_ = GetThreadState().id;
   is_stopped_ = true;
-  ui_->Break(file_path, line); // Blocked here until ui says continue
+  // Blocked here until ui says continue
+  if (exception != Qnil) {
+    ui_->BreakOnException(file_path, line, rb_obj_classname(exception),
+                          GetRubyObjectAsString(exception));
+  } else {
+    ui_->Break(file_path, line);
+  }
   ClearBreakData();
+  EndSuspension();
+  UpdateTracePoints();
 }
 
 // Performs necessary operations when a break point is hit.
-void Server::Impl::DoBreak(const BreakPoint& bp) {
-  frames_ = GetStackFrames();
-
-  // NOTE: This check can only be performed after calling `GetStackFrames`.
-  if (IsBreakPointActive(bp)) {
-    last_break_file_path_ = bp.file;
-    last_break_line_ = bp.line;
-    is_stopped_ = true;
-    ui_->Break(bp); // Blocked here until ui says continue
+void Server::Impl::DoBreak(const BreakPoint& bp, rb_trace_arg_t* trace_arg) {
+  // The condition is evaluated before the stack is captured, which is only
+  // done when the break point actually suspends.
+  if (!IsBreakPointActive(bp, trace_arg))
+    return;
+  if (!bp.log_message.empty() || bp.snapshot) {
+    if (!bp.log_message.empty())
+      LogPointHit(bp, trace_arg);
+    if (bp.snapshot)
+      TakeSnapshot(bp, trace_arg);
+    return;
   }
+
+  BeginSuspension();
+  frames_ = GetStackFrames();
+  RetainFrames();
+  UpdateThreadList();
+  last_break_file_path_ = bp.file;
+  last_break_line_ = bp.line;
+  suspended_thread_id_ = GetThreadState().id;
+  is_stopped_ = true;
+  ui_->Break(bp); // Blocked here until ui says continue
   ClearBreakData();
+  EndSuspension();
+  UpdateTracePoints();
 }
 
-static int EachKeyValFunc(VALUE key, VALUE val, VALUE data) {
-  Server::Impl* impl = reinterpret_cast<Server::Impl*>(data);
-  std::string file_path = StringValueCStr(key);
+// Copies the source lines of a loaded file from SCRIPT_LINES__, if enabled.
+void Server::Impl::ReadScriptLines(const std::string& file_path) {
+  if (script_lines_hash_ == Qnil)
+    return;
 
-  // See if we added this file yet
-  auto itf = impl->script_lines_.find(file_path);
-  if (itf == impl->script_lines_.end()) {
-    // Add the source lines vector
-    auto& lines_vec = impl->script_lines_[file_path];
-    // Add the source code
-    int n = (int)RARRAY_LEN(val);
-    lines_vec.reserve(n);
-    for (int i = 0; i < n; ++i) {
-      VALUE arr_val = RARRAY_PTR(val)[i];
-      const char* val_str = StringValueCStr(arr_val);
-      lines_vec.push_back(val_str);
-    }
+  VALUE lines = rb_hash_lookup(script_lines_hash_,
+                               rb_str_new(file_path.data(), file_path.size()));
+  if (!RB_TYPE_P(lines, T_ARRAY))
+    return;
+
+  std::vector<std::string> lines_vec;
+  long n = RARRAY_LEN(lines);
+  lines_vec.reserve(n);
+  for (long i = 0; i < n; ++i) {
+    VALUE line = rb_ary_entry(lines, i);
+    lines_vec.push_back(RB_TYPE_P(line, T_STRING) ? GetRubyString(line) : "");
   }
-  return ST_CONTINUE;
+  std::lock_guard<std::mutex> lock(break_point_mutex_);
+  script_lines_[file_path].swap(lines_vec);
 }
 
-void Server::Impl::ReadScriptLinesHash() {
-  if (script_lines_hash_ != Qnil) {
-    rb_hash_foreach(script_lines_hash_, (int(*)(VALUE, VALUE, VALUE))EachKeyValFunc, (VALUE)this);
-  }
+// Returns true and sets the full file path of the breakpoint if it matches
+// the given loaded file.
+bool Server::Impl::ResolveBreakPoint(BreakPoint& bp,
+                                     const std::string& file_path) const {
+  if (FindSubstringCaseInsensitive(file_path, bp.file) < 0)
+    return false;
+
+  // Without SCRIPT_LINES__ the number of lines is not known.
+  auto itl = script_lines_.find(file_path);
+  if (itl != script_lines_.end() && bp.line > itl->second.size())
+    return false;
+
+  bp.file = file_path;
+  return true;
 }
 
-bool Server::Impl::ResolveBreakPoint(BreakPoint& bp) {
-  bool resolved = false;
-  for (auto it = script_lines_.cbegin(),
-       ite = script_lines_.cend(); it != ite; ++it) {
-    const std::string& file_path = it->first;
-    if (FindSubstringCaseInsensitive(file_path, bp.file) >= 0) {
-      if (bp.line <= it->second.size()) {
-        bp.file = file_path;
-        resolved = true;
-        break;
-      }
-    }
+bool Server::Impl::ResolveBreakPoint(BreakPoint& bp) const {
+  for (auto it = script_iseqs_.cbegin(),
+       ite = script_iseqs_.cend(); it != ite; ++it) {
+    if (ResolveBreakPoint(bp, it->first))
+      return true;
   }
-  return resolved;
+  return false;
 }
 
-void Server::Impl::ResolveBreakPoints() {
-  // Make sure we have the loaded files
-  ReadScriptLinesHash();
-
+// Resolves the breakpoints which match a newly loaded file. Only called when
+// a script is compiled, never from the line event.
+void Server::Impl::ResolveBreakPoints(const std::string& file_path) {
+  bool resolved = false;
   for (auto it = unresolved_breakpoints_.begin();
        it != unresolved_breakpoints_.end(); ) {
-    if (ResolveBreakPoint(*it)) {
+    if (ResolveBreakPoint(*it, file_path)) {
       AddBreakPoint(*it, true);
       it = unresolved_breakpoints_.erase(it);
+      resolved = true;
     } else {
       ++it;
     }
   }
-  SaveBreakPoints();
+  if (resolved)
+    SaveBreakPoints();
 }
 
 void Server::Impl::AddBreakPoint(BreakPoint& bp, bool is_resolved) {
+  if (!bp.method.empty()) {
+    AddFunctionBreakPoint(bp);
+    return;
+  }
+
   auto existing = GetBreakPoint(bp.file, bp.line);
   if (existing) {
     bp.index = existing->index;
     existing->enabled = bp.enabled;
     existing->condition = bp.condition;
+    existing->hit_condition = bp.hit_condition;
+    existing->hit_value = bp.hit_value;
     return;
   }
 
@@ -574,15 +3106,37 @@ void Server::Impl::AddBreakPoint(BreakPoint& bp, bool is_resolved) {
   if (is_resolved) {
     auto& bp_map = breakpoints_[bp.line];
     bp_map.insert(std::make_pair(bp.file, bp));
+    RequestTracePointUpdate();
   } else {
     unresolved_breakpoints_.push_back(bp);
   }
 }
 
-std::vector<StackFrame> Server::Impl::GetStackFrames() {
-  std::vector<StackFrame> frames;
-  rb_debug_inspector_open(&DebugInspectorFunc, &frames);
-  return frames;
+// Function breakpoints are resolved and armed by UpdateTracePoints().
+void Server::Impl::AddFunctionBreakPoint(BreakPoint& bp) {
+  for (auto& existing : function_breakpoints_) {
+    if (existing.method == bp.method) {
+      bp.index = existing.index;
+      existing.enabled = bp.enabled;
+      existing.condition = bp.condition;
+      existing.hit_condition = bp.hit_condition;
+      existing.hit_value = bp.hit_value;
+      return;
+    }
+  }
+
+  if (bp.index == 0)
+    bp.index = ++last_breakpoint_index;
+  function_breakpoints_.push_back(bp);
+  function_breakpoints_dirty_ = true;
+  RequestTracePointUpdate();
+}
+
+std::vector<StackFrame> Server::Impl::GetStackFrames(size_t max_frames) {
+  StackFramesData data;
+  data.max_frames = max_frames;
+  rb_debug_inspector_open(&DebugInspectorFunc, &data);
+  return data.frames;
 }
 
 VALUE Server::Impl::GetBinding(bool use_toplevel_binding) {
@@ -625,32 +3179,164 @@ void Server::Start(std::unique_ptr<IDebuggerUI> ui,
   }
 
   impl_->LoadBreakPoints();
+  impl_->UpdateThreadList();
+  impl_->suspended_thread_id_ = impl_->GetThreadState().id;
+  // An IDE attaches when it connects, see SetAttached().
+  impl_->is_attached_ = !is_ide;
   impl_->ui_ = std::move(ui);
   impl_->ui_->Initialize(this, str_debugger);
   impl_->is_stopped_ = true;
   impl_->save_breakpoints_ = !is_ide;
   impl_->ui_->WaitForContinue();
   impl_->ClearBreakData();
+  impl_->StartDispatchThread();
+  impl_->UpdateTracePoints();
 }
 
 void Server::Stop() {
+  impl_->StopDispatchThread();
   impl_->DisableTracePoint();
 }
 
+void Server::SetAttached(bool attached) {
+  if (impl_->is_attached_ == attached)
+    return;
+  impl_->is_attached_ = attached;
+  if (!attached)
+    impl_->ClearSuspensionData();
+  else
+    impl_->function_breakpoints_dirty_ = true;
+  impl_->RequestTracePointUpdate();
+}
+
+void Server::SetTracedThreads(const std::vector<size_t>& thread_ids,
+                              bool all_threads) {
+  {
+    std::lock_guard<std::mutex> lock(impl_->break_point_mutex_);
+    impl_->traced_thread_ids_ = thread_ids;
+    impl_->trace_all_threads_ = all_threads;
+    impl_->traced_threads_dirty_ = true;
+  }
+  impl_->RequestTracePointUpdate();
+}
+
+bool Server::RunTo(const std::string& file, size_t line) {
+  {
+    std::lock_guard<std::mutex> lock(impl_->break_point_mutex_);
+    BreakPoint bp;
+    bp.file = file;
+    bp.line = line;
+    if (!impl_->ResolveBreakPoint(bp) ||
+        impl_->script_iseqs_.find(bp.file) == impl_->script_iseqs_.end()) {
+      return false;
+    }
+    impl_->run_to_file_ = bp.file;
+    impl_->run_to_line_ = bp.line;
+    impl_->run_to_pending_ = true;
+  }
+  impl_->ClearSuspensionData();
+  impl_->RequestTracePointUpdate();
+  return true;
+}
+
+bool Server::StepInto(const std::string& method) {
+  if (!IsStopped())
+    return false;
+
+  // "Klass#name" names an instance method, "receiver.name" and "name" the
+  // method of an object.
+  std::string expr;
+  size_t hash = method.rfind('#');
+  size_t dot = method.rfind('.');
+  if (hash != std::string::npos) {
+    expr = method.substr(0, hash) + ".instance_method(:" +
+           method.substr(hash + 1) + ")";
+  } else if (dot != std::string::npos) {
+    expr = "(" + method.substr(0, dot) + ").method(:" +
+           method.substr(dot + 1) + ")";
+  } else {
+    expr = "method(:" + method + ")";
+  }
+  VALUE method_val = EvaluateRubyExpressionAsValue(
+      expr, impl_->GetBinding(false));
+  if (!RTEST(rb_obj_is_kind_of(method_val, rb_cMethod)) &&
+      !RTEST(rb_obj_is_kind_of(method_val, rb_cUnboundMethod))) {
+    return false;
+  }
+
+  // Methods defined in C have no instruction sequence to target.
+  static const ID id_of = rb_intern("of");
+  VALUE iseq_class = rb_path2class("RubyVM::InstructionSequence");
+  if (ProtectFuncall(iseq_class, id_of, 1, method_val) == Qnil)
+    return false;
+
+  // The tracepoint is armed by UpdateTracePoints() before execution resumes.
+  {
+    std::lock_guard<std::mutex> lock(impl_->break_point_mutex_);
+    impl_->step_into_pending_ = true;
+  }
+  impl_->step_into_method_ = method_val;
+  impl_->step_into_thread_ = rb_thread_current();
+  impl_->break_at_next_line_ = false;
+  impl_->thread_states_.ClearSuspensionData();
+  impl_->RequestTracePointUpdate();
+  return true;
+}
+
+bool Server::StepUntil(const std::string& expr, bool step_into) {
+  if (!IsStopped() || impl_->frames_.empty())
+    return false;
+
+  // Execution continues in the top frame, whose locals the predicate refers
+  // to.
+  impl_->until_native_.Compile(expr);
+  impl_->until_proc_ = CompileExpression(expr, impl_->frames_.front().binding,
+                                         impl_->until_locals_);
+  if (impl_->until_proc_ == Qnil)
+    return false;
+  impl_->is_until_frame_known_ = false;
+  impl_->until_self_ = Qnil;
+
+  impl_->ClearSuspensionData();
+  auto& state = impl_->thread_states_.Get(impl_->suspended_thread_id_);
+  state.until_step_into = step_into;
+  state.until_pending = true;
+  impl_->traced_threads_dirty_ = true;
+  return true;
+}
+
+void Server::AddPathFilter(const std::string& path, bool include) {
+  {
+    std::lock_guard<std::mutex> lock(impl_->break_point_mutex_);
+    auto rule = include ? PathFilter::kInclude : PathFilter::kExclude;
+    impl_->path_filter_rules_.push_back(std::make_pair(path, rule));
+    impl_->path_filter_dirty_ = true;
+  }
+  impl_->RequestTracePointUpdate();
+}
+
+void Server::EnablePathFilter(bool enable) {
+  {
+    std::lock_guard<std::mutex> lock(impl_->break_point_mutex_);
+    impl_->path_filter_enabled_ = enable;
+    impl_->path_filter_dirty_ = true;
+  }
+  impl_->RequestTracePointUpdate();
+}
+
 bool Server::AddBreakPoint(BreakPoint& bp, bool assume_resolved) {
   std::lock_guard<std::mutex> lock(impl_->break_point_mutex_);
 
-  // Make sure we have the loaded files
-  impl_->ReadScriptLinesHash();
-
-  // Find a matching full file path for the given file.
-  bool file_resolved = assume_resolved || impl_->ResolveBreakPoint(bp);
+  // Find a matching full file path among the loaded files.
+  bool file_resolved = bp.method.empty() &&
+                       (assume_resolved || impl_->ResolveBreakPoint(bp));
   impl_->AddBreakPoint(bp, file_resolved);
   impl_->SaveBreakPoints();
   return true;
 }
 
 bool Server::RemoveBreakPoint(size_t index) {
+  std::lock_guard<std::mutex> lock(impl_->break_point_mutex_);
   bool removed = false;
 
   // Check resolved breakpoints
@@ -682,13 +3368,28 @@ bool Server::RemoveBreakPoint(size_t index) {
     }
   }
 
+  // Check function breakpoints
+  if (!removed) {
+    for (auto it = impl_->function_breakpoints_.begin(),
+         ite = impl_->function_breakpoints_.end(); it != ite; ++it) {
+      if (index == it->index) {
+        impl_->function_breakpoints_.erase(it);
+        removed = true;
+        break;
+      }
+    }
+  }
+
   if (removed) {
+    impl_->conditions_dirty_ = true;
+    impl_->RequestTracePointUpdate();
     impl_->SaveBreakPoints();
   }
   return removed;
 }
 
 bool Server::RemoveAllBreakPoints() {
+  std::lock_guard<std::mutex> lock(impl_->break_point_mutex_);
   bool removed = false;
 
   if (!impl_->breakpoints_.empty()) {
@@ -701,16 +3402,26 @@ bool Server::RemoveAllBreakPoints() {
     removed = true;
   }
 
+  if (!impl_->function_breakpoints_.empty()) {
+    impl_->function_breakpoints_.clear();
+    removed = true;
+  }
+
   if (removed) {
+    impl_->conditions_dirty_ = true;
+    impl_->RequestTracePointUpdate();
     impl_->SaveBreakPoints();
   }
   return removed;
 }
 
 bool Server::EnableBreakPoint(size_t index, bool enable) {
+  std::lock_guard<std::mutex> lock(impl_->break_point_mutex_);
   auto bp = impl_->GetBreakPoint(index);
   if (bp) {
     bp->enabled = enable;
+    impl_->function_breakpoints_dirty_ = true;
+    impl_->RequestTracePointUpdate();
     return true;
   } else {
     return false;
@@ -718,19 +3429,258 @@ bool Server::EnableBreakPoint(size_t index, bool enable) {
 }
 
 bool Server::ConditionBreakPoint(size_t index, const std::string& condition) {
+  std::lock_guard<std::mutex> lock(impl_->break_point_mutex_);
   auto bp = impl_->GetBreakPoint(index);
   if (bp) {
     bp->condition = condition;
+    bp->condition_quarantined = false;
+    impl_->conditions_dirty_ = true;
     return true;
   } else {
     return false;
   }
 }
 
-std::vector<BreakPoint> Server::GetBreakPoints() const {
-  // Try to resolve any unresolved breakpoints
-  impl_->ResolveBreakPoints();
+bool Server::ResetConditionBreakPoint(size_t index) {
+  std::lock_guard<std::mutex> lock(impl_->break_point_mutex_);
+  auto bp = impl_->GetBreakPoint(index);
+  if (bp == nullptr || !bp->condition_quarantined)
+    return false;
+  // The condition is compiled again on its next evaluation.
+  bp->condition_quarantined = false;
+  impl_->conditions_dirty_ = true;
+  return true;
+}
+
+bool Server::LogBreakPoint(size_t index, const std::string& message) {
+  std::lock_guard<std::mutex> lock(impl_->break_point_mutex_);
+  auto bp = impl_->GetBreakPoint(index);
+  if (bp) {
+    bp->log_message = message;
+    impl_->conditions_dirty_ = true;
+    impl_->SaveBreakPoints();
+    return true;
+  } else {
+    return false;
+  }
+}
+
+bool Server::SnapshotBreakPoint(size_t index, bool snapshot) {
+  std::lock_guard<std::mutex> lock(impl_->break_point_mutex_);
+  auto bp = impl_->GetBreakPoint(index);
+  if (bp) {
+    bp->snapshot = snapshot;
+    impl_->SaveBreakPoints();
+    return true;
+  } else {
+    return false;
+  }
+}
+
+bool Server::LatencyBreakPoint(size_t index, size_t threshold_ms) {
+  std::lock_guard<std::mutex> lock(impl_->break_point_mutex_);
+  auto bp = impl_->GetBreakPoint(index);
+  if (bp == nullptr || bp->method.empty())
+    return false;
+  bp->latency_ms = threshold_ms;
+  impl_->RequestTracePointUpdate();
+  impl_->SaveBreakPoints();
+  return true;
+}
+
+void Server::SetSnapshotLimits(const SnapshotLimits& limits) {
+  std::lock_guard<std::mutex> lock(impl_->snapshots_mutex_);
+  impl_->snapshot_limits_ = limits;
+}
+
+SnapshotLimits Server::GetSnapshotLimits() const {
+  std::lock_guard<std::mutex> lock(impl_->snapshots_mutex_);
+  return impl_->snapshot_limits_;
+}
+
+std::vector<Snapshot> Server::GetSnapshots() const {
+  std::lock_guard<std::mutex> lock(impl_->snapshots_mutex_);
+  return std::vector<Snapshot>(impl_->snapshots_.cbegin(),
+                               impl_->snapshots_.cend());
+}
+
+bool Server::GetSnapshot(size_t id, Snapshot& snapshot) const {
+  std::lock_guard<std::mutex> lock(impl_->snapshots_mutex_);
+  for (const auto& it : impl_->snapshots_) {
+    if (it.id == id) {
+      snapshot = it;
+      return true;
+    }
+  }
+  return false;
+}
+
+void Server::ClearSnapshots() {
+  std::lock_guard<std::mutex> lock(impl_->snapshots_mutex_);
+  impl_->snapshots_.clear();
+}
+
+bool Server::HitConditionBreakPoint(size_t index, HitCondition hit_condition,
+                                    size_t hit_value) {
+  std::lock_guard<std::mutex> lock(impl_->break_point_mutex_);
+  auto bp = impl_->GetBreakPoint(index);
+  if (bp) {
+    bp->hit_condition = hit_condition;
+    bp->hit_value = hit_value;
+    bp->hit_count = 0;
+    impl_->SaveBreakPoints();
+    return true;
+  } else {
+    return false;
+  }
+}
+
+void Server::AddCatchPoint(const std::string& exception_class) {
+  {
+    std::lock_guard<std::mutex> lock(impl_->break_point_mutex_);
+    auto& names = impl_->catch_points_;
+    if (std::find(names.cbegin(), names.cend(), exception_class) != names.cend())
+      return;
+    names.push_back(exception_class);
+  }
+  impl_->catch_points_dirty_ = true;
+  impl_->RequestTracePointUpdate();
+}
+
+bool Server::RemoveCatchPoint(const std::string& exception_class) {
+  {
+    std::lock_guard<std::mutex> lock(impl_->break_point_mutex_);
+    auto& names = impl_->catch_points_;
+    auto it = std::find(names.begin(), names.end(), exception_class);
+    if (it == names.end())
+      return false;
+    names.erase(it);
+  }
+  impl_->catch_points_dirty_ = true;
+  impl_->RequestTracePointUpdate();
+  return true;
+}
+
+void Server::RemoveAllCatchPoints() {
+  {
+    std::lock_guard<std::mutex> lock(impl_->break_point_mutex_);
+    impl_->catch_points_.clear();
+  }
+  impl_->catch_points_dirty_ = true;
+  impl_->RequestTracePointUpdate();
+}
+
+std::vector<std::string> Server::GetCatchPoints() const {
+  std::lock_guard<std::mutex> lock(impl_->break_point_mutex_);
+  return impl_->catch_points_;
+}
+
+void Server::AddAllocationPoint(const AllocationPoint& point) {
+  {
+    std::lock_guard<std::mutex> lock(impl_->break_point_mutex_);
+    auto& points = impl_->allocation_points_;
+    auto it = std::find_if(points.begin(), points.end(),
+                           [&point](const AllocationPoint& existing) {
+                             return existing.file == point.file;
+                           });
+    if (it != points.end()) {
+      it->max_objects = point.max_objects;
+    } else {
+      points.push_back(point);
+    }
+  }
+  impl_->allocation_points_dirty_ = true;
+  impl_->RequestTracePointUpdate();
+}
+
+bool Server::RemoveAllocationPoint(const std::string& file) {
+  {
+    std::lock_guard<std::mutex> lock(impl_->break_point_mutex_);
+    auto& points = impl_->allocation_points_;
+    auto it = std::find_if(points.begin(), points.end(),
+                           [&file](const AllocationPoint& existing) {
+                             return existing.file == file;
+                           });
+    if (it == points.end())
+      return false;
+    points.erase(it);
+  }
+  impl_->allocation_points_dirty_ = true;
+  impl_->RequestTracePointUpdate();
+  return true;
+}
+
+void Server::RemoveAllAllocationPoints() {
+  {
+    std::lock_guard<std::mutex> lock(impl_->break_point_mutex_);
+    impl_->allocation_points_.clear();
+  }
+  impl_->allocation_points_dirty_ = true;
+  impl_->RequestTracePointUpdate();
+}
+
+std::vector<AllocationPoint> Server::GetAllocationPoints() const {
+  std::lock_guard<std::mutex> lock(impl_->break_point_mutex_);
+  return impl_->allocation_points_;
+}
+
+size_t Server::AddWatchPoint(size_t object_id, const std::string& ivar) {
+  if (!IsStopped() || ivar.size() < 2 || ivar[0] != '@' || ivar[1] == '@')
+    return 0;
+  VALUE object = static_cast<VALUE>(object_id);
+  if (SPECIAL_CONST_P(object))
+    return 0;
+
+  WatchPoint watch;
+  watch.object_id = object_id;
+  watch.ivar = ivar;
+  watch.type = rb_obj_classname(object);
+  VALUE entry = rb_ary_new_from_args(
+      2, object, rb_ivar_get(object, rb_intern(ivar.c_str())));
+  {
+    std::lock_guard<std::mutex> lock(impl_->break_point_mutex_);
+    watch.index = ++impl_->last_watch_point_index_;
+    impl_->watch_points_.push_back(watch);
+  }
+  rb_hash_aset(impl_->watch_objects_, SIZET2NUM(watch.index), entry);
+  impl_->watch_points_dirty_ = true;
+  impl_->RequestTracePointUpdate();
+  return watch.index;
+}
+
+bool Server::RemoveWatchPoint(size_t index) {
+  {
+    std::lock_guard<std::mutex> lock(impl_->break_point_mutex_);
+    auto& watches = impl_->watch_points_;
+    auto it = std::find_if(watches.begin(), watches.end(),
+                           [index](const WatchPoint& watch) {
+                             return watch.index == index;
+                           });
+    if (it == watches.end())
+      return false;
+    watches.erase(it);
+  }
+  impl_->watch_points_dirty_ = true;
+  impl_->RequestTracePointUpdate();
+  return true;
+}
+
+void Server::RemoveAllWatchPoints() {
+  {
+    std::lock_guard<std::mutex> lock(impl_->break_point_mutex_);
+    impl_->watch_points_.clear();
+  }
+  impl_->watch_points_dirty_ = true;
+  impl_->RequestTracePointUpdate();
+}
 
+std::vector<WatchPoint> Server::GetWatchPoints() const {
+  std::lock_guard<std::mutex> lock(impl_->break_point_mutex_);
+  return impl_->watch_points_;
+}
+
+std::vector<BreakPoint> Server::GetBreakPoints() const {
+  std::lock_guard<std::mutex> lock(impl_->break_point_mutex_);
   std::vector<BreakPoint> bps;
 
   // Add resolved breakpoints
@@ -746,6 +3696,10 @@ std::vector<BreakPoint> Server::GetBreakPoints() const {
   std::copy(impl_->unresolved_breakpoints_.cbegin(),
             impl_->unresolved_breakpoints_.cend(), std::back_inserter(bps));
 
+  // Add function breakpoints
+  std::copy(impl_->function_breakpoints_.cbegin(),
+            impl_->function_breakpoints_.cend(), std::back_inserter(bps));
+
   // Sort by index
   std::sort(bps.begin(), bps.end(), &SortBreakPoints);
   return bps;
@@ -791,27 +3745,124 @@ void Server::SetActiveFrameIndex(size_t index) const {
   impl_->active_frame_index_ = index;
 }
 
+// Steps apply to the suspended thread only, which is traced until the step
+// completes even if it is not one of the selected threads.
 void Server::Step() {
-  if (IsStopped())
-    impl_->break_at_next_line_ = true;
+  if (IsStopped()) {
+    auto& state = impl_->thread_states_.Get(impl_->suspended_thread_id_);
+    state.break_at_next_line = true;
+    impl_->traced_threads_dirty_ = true;
+  }
 }
 
 void Server::StepOver() {
   if (IsStopped()) {
-    impl_->stepover_break_at_next_line_ = true;
-    impl_->stepover_to_call_depth_ = impl_->call_depth_;
+    auto& state = impl_->thread_states_.Get(impl_->suspended_thread_id_);
+    state.step_depth = 0;
+    state.stepover_break_at_next_line = true;
+    impl_->traced_threads_dirty_ = true;
   }
 }
 
 void Server::StepOut() {
-  if (IsStopped() && impl_->call_depth_ > 1) {
-    impl_->stepout_to_call_depth_ = impl_->call_depth_ - 1;
+  // Frames are counted from the moment of the step command. There is nothing
+  // to step out to from the outermost frame.
+  if (IsStopped() && impl_->frames_.size() > 1) {
+    auto& state = impl_->thread_states_.Get(impl_->suspended_thread_id_);
+    state.step_depth = 0;
+    state.stepout_break_at_next_line = true;
+    impl_->traced_threads_dirty_ = true;
   }
 }
 
+namespace {
+
+struct BlockingCall {
+  const std::function<void(void)>* func;
+  const std::function<void(void)>* unblock;
+  bool called;
+};
+
+void* CallBlockingFunc(void* data) {
+  BlockingCall* call = reinterpret_cast<BlockingCall*>(data);
+  call->called = true;
+  (*call->func)();
+  return nullptr;
+}
+
+void CallUnblockFunc(void* data) {
+  BlockingCall* call = reinterpret_cast<BlockingCall*>(data);
+  (*call->unblock)();
+}
+
+VALUE CheckInterrupts(VALUE) {
+  rb_thread_check_ints();
+  return Qnil;
+}
+
+} // end anonymous namespace
+
+void Server::WaitWithoutGVL(const std::function<void(void)>& func,
+                            const std::function<void(void)>& unblock) {
+  // rb_thread_call_without_gvl2() returns without calling func while
+  // interrupts are pending, e.g. when other threads want the GVL. They are
+  // serviced here, which lets those threads run, and must not unwind the UI's
+  // wait, so an exception raised into this thread is dropped.
+  BlockingCall call = { &func, &unblock, false };
+  while (true) {
+    rb_thread_call_without_gvl2(&CallBlockingFunc, &call, &CallUnblockFunc,
+                                &call);
+    if (call.called)
+      break;
+    int error = 0;
+    rb_protect(CheckInterrupts, Qnil, &error);
+    if (error) {
+      LOG("Interrupt of the suspended thread ignored.");
+      rb_set_errinfo(Qnil);
+    }
+  }
+}
+
+std::vector<ThreadInfo> Server::GetThreads() const {
+  std::lock_guard<std::mutex> lock(impl_->threads_mutex_);
+  return impl_->threads_;
+}
+
+size_t Server::GetCurrentThreadId() const {
+  return impl_->suspended_thread_id_;
+}
+
+bool Server::StopThread(size_t id) {
+  {
+    std::lock_guard<std::mutex> lock(impl_->threads_mutex_);
+    auto it = std::find_if(impl_->threads_.cbegin(), impl_->threads_.cend(),
+                           [id](const ThreadInfo& info) {
+                             return info.id == id;
+                           });
+    if (it == impl_->threads_.cend())
+      return false;
+  }
+  impl_->thread_states_.Get(id).stop_requested = true;
+  impl_->traced_threads_dirty_ = true;
+  impl_->RequestTracePointUpdate();
+  return true;
+}
+
+bool Server::ResumeThread(size_t id) {
+  ThreadState* state = impl_->thread_states_.Find(id);
+  if (state != nullptr && state->stop_requested) {
+    state->stop_requested = false;
+    impl_->traced_threads_dirty_ = true;
+    impl_->RequestTracePointUpdate();
+  }
+  return state != nullptr || id == impl_->suspended_thread_id_;
+}
+
 void Server::Pause() {
   if (!IsStopped()) {
-    impl_->break_at_next_line_ = true;
+    // No line hook may be enabled while running, the dispatch thread enables
+    // one for the next line only.
+    impl_->RequestPause();
   }
 }
 
@@ -819,8 +3870,7 @@ std::vector<std::pair<size_t, std::string>>
       Server::GetCodeLines(size_t beg_line, size_t end_line) const {
   std::vector<std::pair<size_t, std::string>> lines;
   if (IsStopped()) {
-    impl_->ReadScriptLinesHash();
-
+    std::lock_guard<std::mutex> lock(impl_->break_point_mutex_);
     auto itf = impl_->script_lines_.find(impl_->last_break_file_path_);
     if (itf != impl_->script_lines_.end()) {
       const auto& lines_vec = itf->second;
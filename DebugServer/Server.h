@@ -23,6 +23,15 @@ public:
 
   virtual void Stop();
 
+  virtual void SetAttached(bool attached);
+
+  virtual void SetTracedThreads(const std::vector<size_t>& thread_ids,
+                                bool all_threads);
+
+  virtual void AddPathFilter(const std::string& path, bool include);
+
+  virtual void EnablePathFilter(bool enable);
+
   virtual bool AddBreakPoint(BreakPoint& bp, bool assume_resolved);
 
   virtual bool RemoveBreakPoint(size_t index);
@@ -33,8 +42,53 @@ public:
 
   virtual bool ConditionBreakPoint(size_t index, const std::string& condition);
 
+  virtual bool ResetConditionBreakPoint(size_t index);
+
+  virtual bool HitConditionBreakPoint(size_t index, HitCondition hit_condition,
+                                      size_t hit_value);
+
+  virtual bool LogBreakPoint(size_t index, const std::string& message);
+
+  virtual bool SnapshotBreakPoint(size_t index, bool snapshot);
+
+  virtual bool LatencyBreakPoint(size_t index, size_t threshold_ms);
+
+  virtual void SetSnapshotLimits(const SnapshotLimits& limits);
+
+  virtual SnapshotLimits GetSnapshotLimits() const;
+
+  virtual std::vector<Snapshot> GetSnapshots() const;
+
+  virtual bool GetSnapshot(size_t id, Snapshot& snapshot) const;
+
+  virtual void ClearSnapshots();
+
   virtual std::vector<BreakPoint> GetBreakPoints() const;
 
+  virtual void AddCatchPoint(const std::string& exception_class);
+
+  virtual bool RemoveCatchPoint(const std::string& exception_class);
+
+  virtual void RemoveAllCatchPoints();
+
+  virtual std::vector<std::string> GetCatchPoints() const;
+
+  virtual void AddAllocationPoint(const AllocationPoint& point);
+
+  virtual bool RemoveAllocationPoint(const std::string& file);
+
+  virtual void RemoveAllAllocationPoints();
+
+  virtual std::vector<AllocationPoint> GetAllocationPoints() const;
+
+  virtual size_t AddWatchPoint(size_t object_id, const std::string& ivar);
+
+  virtual bool RemoveWatchPoint(size_t index);
+
+  virtual void RemoveAllWatchPoints();
+
+  virtual std::vector<WatchPoint> GetWatchPoints() const;
+
   virtual bool IsStopped() const;
 
   virtual Variable EvaluateExpression(const std::string& expr);
@@ -53,8 +107,25 @@ public:
 
   virtual void StepOut();
 
+  virtual bool StepInto(const std::string& method);
+
+  virtual bool StepUntil(const std::string& expr, bool step_into);
+
+  virtual bool RunTo(const std::string& file, size_t line);
+
   virtual void Pause();
 
+  virtual void WaitWithoutGVL(const std::function<void(void)>& func,
+                              const std::function<void(void)>& unblock);
+
+  virtual std::vector<ThreadInfo> GetThreads() const;
+
+  virtual size_t GetCurrentThreadId() const;
+
+  virtual bool StopThread(size_t id);
+
+  virtual bool ResumeThread(size_t id);
+
   virtual std::vector<std::pair<size_t, std::string>>
       GetCodeLines(size_t beg_line, size_t end_line) const;
 
@@ -0,0 +1,190 @@
+// SketchUp Ruby API Debugger. Copyright 2026 Trimble Inc.
+//
+#ifndef RDEBUGGER_DEBUGSERVER_THREADSTATES_H_
+#define RDEBUGGER_DEBUGSERVER_THREADSTATES_H_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace SketchUp {
+namespace RubyDebugger {
+
+// Stepping state of a Ruby thread. The step flags and the depth are atomic,
+// since the UI sets them while the thread is suspended or to stop it, and
+// resets them from its own thread, e.g. when a run-to command is given or
+// the client detaches.
+struct ThreadState {
+  explicit ThreadState(size_t id)
+    : id(id),
+      break_at_next_line(false),
+      stepout_break_at_next_line(false),
+      stepover_break_at_next_line(false),
+      stop_requested(false),
+      until_pending(false),
+      until_step_into(false),
+      step_depth(0),
+      block_depth(0),
+      latency_depth(0),
+      latency_overflow(0),
+      allocation_generation(0),
+      allocation_depth(0),
+      allocation_overflow(0) {}
+
+  bool IsSteppingPending() const {
+    return break_at_next_line || stepout_break_at_next_line ||
+           stepover_break_at_next_line || stop_requested || until_pending;
+  }
+
+  void ClearSuspensionData() {
+    break_at_next_line = false;
+    stepout_break_at_next_line = false;
+    stepover_break_at_next_line = false;
+    stop_requested = false;
+    until_pending = false;
+    until_step_into = false;
+    step_depth = 0;
+    block_depth = 0;
+  }
+
+  // Thread#object_id of the thread.
+  size_t id;
+
+  std::atomic<bool> break_at_next_line;
+
+  std::atomic<bool> stepout_break_at_next_line;
+
+  std::atomic<bool> stepover_break_at_next_line;
+
+  // Set by a `thread stop` command until the thread suspends.
+  std::atomic<bool> stop_requested;
+
+  // Set by an until command, which steps until its predicate is true.
+  std::atomic<bool> until_pending;
+
+  // Whether the until command steps into calls or over them.
+  std::atomic<bool> until_step_into;
+
+  // Depth of the current Ruby frame relative to the frame in which the last
+  // step command was given. Only maintained while a step is pending.
+  std::atomic<long> step_depth;
+
+  // The block frames among step_depth, which until counts separately.
+  std::atomic<long> block_depth;
+
+  // A call timed by a latency breakpoint.
+  struct LatencyFrame {
+    size_t index;
+    std::chrono::steady_clock::time_point start;
+  };
+
+  static const size_t kMaxLatencyFrames = 32;
+
+  // The timed calls of the thread, innermost last. Only touched by the thread
+  // itself. Calls nested deeper than the stack are only counted and are not
+  // timed.
+  LatencyFrame latency_frames[kMaxLatencyFrames];
+  size_t latency_depth;
+  size_t latency_overflow;
+
+  // The number of objects allocated when the current line of a frame started,
+  // and that line.
+  struct AllocationFrame {
+    size_t allocated;
+    int line;
+  };
+
+  static const size_t kMaxAllocationFrames = 64;
+
+  // The frames of the code traced for allocation points, innermost last. Only
+  // touched by the thread itself, and dropped when the allocation points are
+  // armed again, which is when allocation_generation changes.
+  size_t allocation_generation;
+  AllocationFrame allocation_frames[kMaxAllocationFrames];
+  size_t allocation_depth;
+  size_t allocation_overflow;
+};
+
+// Owns the state of each Ruby thread seen by the debugger. The event hooks
+// cache the state of their thread in a thread-local slot, the lock is only
+// taken when a thread is seen for the first time and by the UI.
+class ThreadStates {
+public:
+  ThreadStates() : generation_(0) {}
+
+  ThreadState& Get(size_t id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& state = states_[id];
+    if (!state)
+      state.reset(new ThreadState(id));
+    return *state;
+  }
+
+  ThreadState* Find(size_t id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = states_.find(id);
+    return it != states_.end() ? it->second.get() : nullptr;
+  }
+
+  bool IsSteppingPending() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& it : states_) {
+      if (it.second->IsSteppingPending())
+        return true;
+    }
+    return false;
+  }
+
+  // Returns the ids of the threads which were asked to stop or have a step
+  // pending.
+  std::vector<size_t> GetSteppingIds() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<size_t> ids;
+    for (const auto& it : states_) {
+      if (it.second->IsSteppingPending())
+        ids.push_back(it.first);
+    }
+    return ids;
+  }
+
+  void ClearSuspensionData() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& it : states_) {
+      it.second->ClearSuspensionData();
+    }
+  }
+
+  // Drops the states of the threads which are not alive anymore. Thread-local
+  // slots cached before the current generation must not be used.
+  void Prune(const std::vector<size_t>& alive_ids) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    bool pruned = false;
+    for (auto it = states_.begin(); it != states_.end(); ) {
+      if (std::find(alive_ids.cbegin(), alive_ids.cend(), it->first) ==
+          alive_ids.cend()) {
+        it = states_.erase(it);
+        pruned = true;
+      } else {
+        ++it;
+      }
+    }
+    if (pruned)
+      ++generation_;
+  }
+
+  size_t generation() const { return generation_; }
+
+private:
+  mutable std::mutex mutex_;
+  std::map<size_t, std::unique_ptr<ThreadState>> states_;
+  std::atomic<size_t> generation_;
+};
+
+} // end namespace RubyDebugger
+} // end namespace SketchUp
+
+#endif // RDEBUGGER_DEBUGSERVER_THREADSTATES_H_
@@ -35,6 +35,7 @@ void PrintHelp() {
   std::cout << std::endl << "Debugger help\n"
   "Commands\n"
   "  b[reak] file:line          set breakpoint to some position\n"
+  "  b[reak] Klass#method       set breakpoint on a method (Module.method)\n"
   "  b[reak]                    list breakpoints\n"
   "  del[ete]                   delete a breakpoint\n"
   "  c[ont]                     run until program ends or hits a breakpoint\n"
@@ -62,7 +63,11 @@ void WriteText(const char* message) {
 }
 
 void WriteBreakPoint(const BreakPoint& bp) {
-  std::cout << "  " << bp.index << " " << bp.file << ":" << bp.line << "\n";
+  if (!bp.method.empty()) {
+    std::cout << "  " << bp.index << " " << bp.method << "\n";
+  } else {
+    std::cout << "  " << bp.index << " " << bp.file << ":" << bp.line << "\n";
+  }
 }
 
 void WriteBreakPoints(const std::vector<BreakPoint>& bps) {
@@ -152,6 +157,7 @@ bool ConsoleUI::EvaluateCommand(const std::string& str_command) {
   expression_to_evaluate_.clear();
 
   static const std::regex reg_brk_list("^\\s*b(?:reak)?$");
+  static const std::regex reg_brk_method("^\\s*b(?:reak)?\\s+([A-Z][\\w:]*[#.][^\\s#.:]+)$");
   static const std::regex reg_brk("^\\s*b(?:reak)?\\s+(?:(.+):)?([^.:]+)$");
   static const std::regex reg_brk_del("^\\s*del(?:ete)?(?:\\s+(\\d+))?$");
   static const std::regex reg_cont("^\\s*c(?:ont)?$");
@@ -181,6 +187,18 @@ bool ConsoleUI::EvaluateCommand(const std::string& str_command) {
       }
       is_legal_command = true;
     } catch(boost::bad_lexical_cast&) {}
+  } else if (regex_match(str_command, what, reg_brk_method)) {
+    // Add function breakpoint
+    BreakPoint bp;
+    bp.method = what[1];
+    bp.enabled = true;
+    if (server_->AddBreakPoint(bp)) {
+      WriteText("Added breakpoint:");
+      WriteBreakPoint(bp);
+    } else {
+      WriteText("Cannot add breakpoint");
+    }
+    is_legal_command = true;
   } else if (regex_match(str_command, what, reg_brk)) {
     // Add breakpoint
     if (what.size() == 3) {
@@ -339,6 +357,33 @@ void ConsoleUI::Break(const std::string& file, size_t line) {
   WaitForContinue();
 }
 
+void ConsoleUI::BreakOnException(const std::string& file, size_t line,
+                                 const std::string& type,
+                                 const std::string& message) {
+  {
+    std::unique_lock<std::mutex> lock(console_output_mutex_);
+    std::cout << std::endl << type << " raised at " << file << ":" << line
+              << ": " << message;
+    WriteCurrentLine();
+    WritePrompt();
+  }
+  WaitForContinue();
+}
+
+void ConsoleUI::LogPoint(const BreakPoint& bp, const std::string& message) {
+  std::unique_lock<std::mutex> lock(console_output_mutex_);
+  std::cout << std::endl << "LogPoint " << bp.index << " at " << bp.file
+            << ":" << bp.line << ": " << message;
+}
+
+void ConsoleUI::ConditionQuarantined(const BreakPoint& bp,
+                                     const std::string& reason) {
+  std::unique_lock<std::mutex> lock(console_output_mutex_);
+  std::cout << std::endl << "Condition of BreakPoint " << bp.index
+            << " disabled, it " << reason << ": " << bp.condition;
+  WritePrompt();
+}
+
 void ConsoleUI::WriteCodeLines()
 {
   auto code_lines = server_->GetCodeLines(0, 0);
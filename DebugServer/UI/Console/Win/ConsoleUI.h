@@ -32,6 +32,15 @@ public:
 
   virtual void Break(const std::string& file, size_t line);
 
+  virtual void BreakOnException(const std::string& file, size_t line,
+                                const std::string& type,
+                                const std::string& message);
+
+  virtual void LogPoint(const BreakPoint& bp, const std::string& message);
+
+  virtual void ConditionQuarantined(const BreakPoint& bp,
+                                    const std::string& reason);
+
 private:
   void ConsoleThreadFunc();
   bool EvaluateCommand(const std::string& str_command);
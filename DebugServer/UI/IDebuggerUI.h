@@ -36,6 +36,19 @@ public:
   // Called by the server when a file/line breakpoint is hit during execution.
   virtual void Break(const std::string& file, size_t line) = 0;
 
+  // Called by the server when an exception matching a catch point is raised.
+  virtual void BreakOnException(const std::string& file, size_t line,
+                                const std::string& type,
+                                const std::string& message) = 0;
+
+  // Called by the server when a logpoint is hit. Must not block.
+  virtual void LogPoint(const BreakPoint& bp, const std::string& message) = 0;
+
+  // Called by the server when the condition of a breakpoint is not evaluated
+  // anymore because it raised too often or was too slow.
+  virtual void ConditionQuarantined(const BreakPoint& bp,
+                                    const std::string& reason) = 0;
+
 protected:
   IDebuggerUI() : server_(nullptr) {}
 
@@ -27,6 +27,7 @@
 
 #include <DebugServer/IDebugServer.h>
 #include <DebugServer/Log.h>
+#include <DebugServer/RingBuffer.h>
 #include <Common/BreakPoint.h>
 #include <Common/StackFrame.h>
 
@@ -35,14 +36,18 @@ namespace RubyDebugger {
 
 static const int DefaultPort = 1234;
 
+// Interval at which logpoint messages are sent to the client.
+static const int LogIntervalMs = 100;
+
 class RDIP::Impl : public std::enable_shared_from_this<Impl> {
 public:
-  Impl(IDebugServer *server, int port);
+  Impl(IDebugServer *server, int port, bool all_stop);
   ~Impl();
 
   bool isClientConnected() const { return socket_.is_open(); }
 
   void postResponse(const std::string &response);
+  void postLog(const BreakPoint &bp, const std::string &message);
   void wait();
 
 private:
@@ -66,6 +71,9 @@ private:
   void doCheckWorkQueue();
   void handleCheckWorkQueue(const boost::system::error_code &err);
 
+  void doSendLogs();
+  void handleSendLogs(const boost::system::error_code &err);
+
   IDebugServer *server_;
 
   boost::asio::io_service io_service_;
@@ -76,6 +84,7 @@ private:
   boost::asio::ip::tcp::acceptor acceptor_;
   boost::asio::streambuf read_buffer_;
 
+  bool all_stop_;
   bool is_waiting_;
   bool stop_waiting_;
   std::mutex wait_mutex_;
@@ -84,16 +93,29 @@ private:
   std::queue<std::function<void(void)>> work_queue_;
   std::mutex work_queue_mutex_;
   boost::asio::deadline_timer work_queue_timer_;
+
+  // Logpoint messages pushed by the Ruby thread hitting the logpoint, which
+  // holds the GVL, and sent in batches by the service thread.
+  struct LogEntry {
+    size_t bp_index;
+    std::string file;
+    size_t line;
+    std::string message;
+  };
+  RingBuffer<LogEntry, 1024> log_buffer_;
+  boost::asio::deadline_timer log_timer_;
 };
 
-RDIP::Impl::Impl(IDebugServer *server, int port)
+RDIP::Impl::Impl(IDebugServer *server, int port, bool all_stop)
   : server_(server)
   , signal_set_(io_service_, SIGINT, SIGTERM, SIGSEGV)
   , socket_(io_service_)
   , acceptor_(io_service_, boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), port))
+  , all_stop_(all_stop)
   , is_waiting_(false)
   , stop_waiting_(false)
-  , work_queue_timer_(io_service_) {
+  , work_queue_timer_(io_service_)
+  , log_timer_(io_service_) {
   signal_set_.async_wait(std::bind(&RDIP::Impl::handleError, this, std::placeholders::_1, std::placeholders::_2));
 
   service_thread_ = std::thread([this](){
@@ -112,13 +134,25 @@ void RDIP::Impl::postResponse(const std::string &response) {
   io_service_.post(std::bind(&RDIP::Impl::sendResponse, this, response));
 }
 
+void RDIP::Impl::postLog(const BreakPoint &bp, const std::string &message) {
+  log_buffer_.Push(LogEntry{bp.index, bp.file, bp.line, message});
+}
+
 void RDIP::Impl::wait() {
   std::unique_lock<std::mutex> lock(wait_mutex_);
 
   is_waiting_ = true;
   stop_waiting_ = false;
   do {
-    wait_cond_.wait(lock);
+    // Other Ruby threads keep running unless all-stop was requested. The
+    // queued work runs after the GVL is acquired again. The wait mutex is not
+    // held while reacquiring the GVL, since the unblock function locks it.
+    if (all_stop_) {
+      wait_cond_.wait(lock);
+    } else {
+      server_->WaitWithoutGVL([&](){ wait_cond_.wait(lock); lock.unlock(); }, [this](){ notifyWait(false); });
+    }
+    if (!lock.owns_lock()) lock.lock();
     processWorkQueue();
   } while (!stop_waiting_);
   is_waiting_ = false;
@@ -136,6 +170,10 @@ void RDIP::Impl::closeConnection() {
     socket_.close();
 
     server_->RemoveAllBreakPoints();
+    server_->RemoveAllCatchPoints();
+    server_->RemoveAllAllocationPoints();
+    server_->RemoveAllWatchPoints();
+    server_->SetAttached(false);
   }
   notifyWait(true);
 }
@@ -156,7 +194,9 @@ void RDIP::Impl::handleAccept(const boost::system::error_code &err) {
   }
 
   LOG("Accepted connection from ruby-debug-ide client.");
+  server_->SetAttached(true);
   doReadUntil();
+  doSendLogs();
 }
 
 void RDIP::Impl::doReadUntil() {
@@ -185,6 +225,25 @@ void RDIP::Impl::handleReadUntil(const boost::system::error_code &err, size_t by
   doReadUntil();
 }
 
+// Selects the traced threads from "all", "main" or a list of thread ids.
+static void setTracedThreads(IDebugServer *server, const std::string &threads) {
+  std::vector<size_t> thread_ids;
+  static const std::regex id_regex("\\d+");
+  static const std::sregex_token_iterator end;
+  for (std::sregex_token_iterator iter(threads.begin(), threads.end(), id_regex, 0); iter != end; ++iter) {
+    thread_ids.push_back(boost::lexical_cast<size_t>(iter->str()));
+  }
+  server->SetTracedThreads(thread_ids, boost::iequals(threads, "all"));
+}
+
+static std::string threadXml(const ThreadInfo &thread) {
+  std::ostringstream xml;
+  xml << "<thread id=\"" << thread.id << "\" status=\"" << thread.status << "\"";
+  if (thread.is_current) xml << " current=\"yes\"";
+  xml << " />";
+  return xml.str();
+}
+
 static std::string escapeXml(const std::string& str) {
   std::ostringstream escaped;
   std::for_each(str.begin(), str.end(), [&](char ch){
@@ -211,19 +270,30 @@ void RDIP::Impl::evaluateCommand(const std::string &command) {
   // This represents only a subset of all commands defined by ruby-debug-ide.
   //
   // For reference, here are the commands that are not yet supported:
-  //    catch, restart, detach, pp, expression_info,
-  //    include, exclude, file-filter, up, down, jump, load,
-  //    set_type, thread switch, thread inspect, thread stop,
-  //    thread current, thread resume, var constant
+  //    restart, pp, expression_info,
+  //    up, down, jump, load,
+  //    set_type, thread inspect, var constant
 
   // Breakpoint-related commands.
+  static const std::regex add_function_breakpoint_regex("^b(?:reak)?\\s+([A-Z][\\w:]*[#.][^\\s#.:]+)(?:\\s+if\\s+(.+))?$");
   static const std::regex add_breakpoint_regex("^b(?:reak)?\\s+(.+?):(\\d+)(?:\\s+if\\s+(.+))?$", std::regex_constants::icase);
   static const std::regex breakpoints_regex("^(?:info\\s*)?b(?:reak)?$", std::regex_constants::icase);
+  static const std::regex condition_reset_regex("^cond(?:ition)?\\s+reset\\s+(\\d+)$", std::regex_constants::icase);
   static const std::regex condition_regex("^cond(?:ition)?\\s+(\\d+)(?:\\s+(.+))?$", std::regex_constants::icase);
+  static const std::regex hit_condition_regex("^hit\\s+(\\d+)(?:\\s*(==|>=|%)\\s*(\\d+))?$", std::regex_constants::icase);
+  static const std::regex log_message_regex("^log\\s+(\\d+)(?:\\s+(.+))?$", std::regex_constants::icase);
+  static const std::regex latency_regex("^latency\\s+(\\d+)(?:\\s+(\\d+))?$", std::regex_constants::icase);
   static const std::regex delete_breakpoint_regex("^del(?:ete)?(?:\\s+(\\d+))?$", std::regex_constants::icase);
   static const std::regex enable_breakpoint_regex("^(en|dis)(?:able)?\\s+breakpoints((?:\\s+\\d+)+)$", std::regex_constants::icase);
 
-  if (std::regex_match(command, match, add_breakpoint_regex)) {
+  if (std::regex_match(command, match, add_function_breakpoint_regex)) {
+    BreakPoint bp;
+    bp.method = match[1];
+    bp.enabled = true;
+    if (match[2].matched) bp.condition = match[2];
+    server_->AddBreakPoint(bp, false);
+    response << "<breakpointAdded no=\"" << bp.index << "\" location=\"" << escapeXml(bp.method) << "\" />";
+  } else if (std::regex_match(command, match, add_breakpoint_regex)) {
     BreakPoint bp;
     bp.file = match[1];
     boost::replace_all(bp.file, "\\", "/");
@@ -236,9 +306,20 @@ void RDIP::Impl::evaluateCommand(const std::string &command) {
     response << "<breakpoints>";
     auto bps = server_->GetBreakPoints();
     std::for_each(bps.begin(), bps.end(), [&](auto &bp){
-      response << "<breakpoint n=\"" << bp.index << "\" file=\"" << escapeXml(bp.file) << "\" line=\"" << bp.line << "\" />";
+      response << "<breakpoint n=\"" << bp.index << "\" file=\"" << escapeXml(bp.file) << "\" line=\"" << bp.line << "\" hitCount=\"" << bp.hit_count << "\"";
+      if (!bp.method.empty()) response << " method=\"" << escapeXml(bp.method) << "\"";
+      if (bp.latency_ms != 0) response << " latency=\"" << bp.latency_ms << "\"";
+      if (!bp.log_message.empty()) response << " logMessage=\"" << escapeXml(bp.log_message) << "\"";
+      if (bp.snapshot) response << " snapshot=\"true\"";
+      if (bp.condition_quarantined) response << " conditionQuarantined=\"true\"";
+      response << " />";
     });
     response << "</breakpoints>";
+  } else if (std::regex_match(command, match, condition_reset_regex)) {
+    size_t index = boost::lexical_cast<size_t>(match[1]);
+    if (server_->ResetConditionBreakPoint(index)) {
+      response << "<conditionReset bp_id=\"" << index << "\" />";
+    }
   } else if (std::regex_match(command, match, condition_regex)) {
     size_t index = boost::lexical_cast<size_t>(match[1]);
     std::string condition;
@@ -246,6 +327,32 @@ void RDIP::Impl::evaluateCommand(const std::string &command) {
     if (server_->ConditionBreakPoint(index, condition)) {
       response << "<conditionSet bp_id=\"" << index << "\" />";
     }
+  } else if (std::regex_match(command, match, hit_condition_regex)) {
+    size_t index = boost::lexical_cast<size_t>(match[1]);
+    HitCondition hit_condition = HitCondition::kNone;
+    size_t hit_value = 0;
+    if (match[2].matched) {
+      std::string op = match[2];
+      hit_condition = op == "==" ? HitCondition::kEqual : op == ">=" ? HitCondition::kGreaterOrEqual : HitCondition::kMultiple;
+      hit_value = boost::lexical_cast<size_t>(match[3]);
+    }
+    if (server_->HitConditionBreakPoint(index, hit_condition, hit_value)) {
+      response << "<hitConditionSet bp_id=\"" << index << "\" />";
+    }
+  } else if (std::regex_match(command, match, log_message_regex)) {
+    size_t index = boost::lexical_cast<size_t>(match[1]);
+    std::string message;
+    if (match[2].matched) message = match[2];
+    if (server_->LogBreakPoint(index, message)) {
+      response << "<logMessageSet bp_id=\"" << index << "\" />";
+    }
+  } else if (std::regex_match(command, match, latency_regex)) {
+    size_t index = boost::lexical_cast<size_t>(match[1]);
+    size_t threshold_ms = 0;
+    if (match[2].matched) threshold_ms = boost::lexical_cast<size_t>(match[2]);
+    if (server_->LatencyBreakPoint(index, threshold_ms)) {
+      response << "<latencySet bp_id=\"" << index << "\" ms=\"" << threshold_ms << "\" />";
+    }
   } else if (std::regex_match(command, match, delete_breakpoint_regex)) {
     if (match[1].matched) {
       size_t index = boost::lexical_cast<size_t>(match[1]);
@@ -267,13 +374,193 @@ void RDIP::Impl::evaluateCommand(const std::string &command) {
     }
   }
 
+  // Catchpoint-related commands.
+  static const std::regex catch_regex("^catch(?:\\s+(\\S+?))?(?:\\s+(off))?$", std::regex_constants::icase);
+
+  if (std::regex_match(command, match, catch_regex)) {
+    if (!match[1].matched) {
+      response << "<catchpoints>";
+      for (const auto &exception_class : server_->GetCatchPoints()) {
+        response << "<catchpoint exception=\"" << escapeXml(exception_class) << "\" />";
+      }
+      response << "</catchpoints>";
+    } else if (boost::iequals(match.str(1), "off")) {
+      server_->RemoveAllCatchPoints();
+      response << "<catchpointsDeleted />";
+    } else if (match[2].matched) {
+      if (server_->RemoveCatchPoint(match[1])) {
+        response << "<catchpointDeleted exception=\"" << escapeXml(match[1]) << "\" />";
+      } else {
+        response << "<error>No catchpoint for " << escapeXml(match[1]) << "</error>";
+      }
+    } else {
+      server_->AddCatchPoint(match[1]);
+      response << "<catchpointSet exception=\"" << escapeXml(match[1]) << "\" />";
+    }
+  }
+
+  // Allocation point commands.
+  static const std::regex alloc_regex("^alloc(?:\\s+(.+?))?(?:\\s+(\\d+|off))?$", std::regex_constants::icase);
+
+  if (std::regex_match(command, match, alloc_regex)) {
+    if (!match[1].matched) {
+      response << "<allocpoints>";
+      for (const auto &point : server_->GetAllocationPoints()) {
+        response << "<allocpoint file=\"" << escapeXml(point.file) << "\" objects=\"" << point.max_objects << "\" />";
+      }
+      response << "</allocpoints>";
+    } else if (!match[2].matched && boost::iequals(match.str(1), "off")) {
+      server_->RemoveAllAllocationPoints();
+      response << "<allocpointsDeleted />";
+    } else if (!match[2].matched) {
+      response << "<error>Missing number of objects for " << escapeXml(match[1]) << "</error>";
+    } else if (boost::iequals(match.str(2), "off")) {
+      std::string file = match[1];
+      boost::replace_all(file, "\\", "/");
+      if (server_->RemoveAllocationPoint(file)) {
+        response << "<allocpointDeleted file=\"" << escapeXml(file) << "\" />";
+      } else {
+        response << "<error>No allocpoint for " << escapeXml(file) << "</error>";
+      }
+    } else {
+      AllocationPoint point;
+      point.file = match[1];
+      boost::replace_all(point.file, "\\", "/");
+      point.max_objects = boost::lexical_cast<size_t>(match[2]);
+      server_->AddAllocationPoint(point);
+      response << "<allocpointSet file=\"" << escapeXml(point.file) << "\" objects=\"" << point.max_objects << "\" />";
+    }
+  }
+
+  // Watch point commands. Object ids are only valid while suspended.
+  static const std::regex watch_regex("^watch(?:\\s+(?:0x)?([\\da-f]+)\\s+(@\\w+))?$", std::regex_constants::icase);
+  static const std::regex watch_delete_regex("^watch\\s+(?:(\\d+)\\s+)?off$", std::regex_constants::icase);
+
+  if (std::regex_match(command, match, watch_delete_regex)) {
+    if (!match[1].matched) {
+      server_->RemoveAllWatchPoints();
+      response << "<watchpointsDeleted />";
+    } else {
+      size_t index = boost::lexical_cast<size_t>(match[1]);
+      if (server_->RemoveWatchPoint(index)) {
+        response << "<watchpointDeleted n=\"" << index << "\" />";
+      } else {
+        response << "<error>No watchpoint " << index << "</error>";
+      }
+    }
+  } else if (std::regex_match(command, match, watch_regex)) {
+    if (!match[1].matched) {
+      response << "<watchpoints>";
+      for (const auto &watch : server_->GetWatchPoints()) {
+        response << "<watchpoint n=\"" << watch.index << "\" objectId=\"0x" << std::hex << watch.object_id << std::dec << "\" ivar=\"" << escapeXml(watch.ivar) << "\" type=\"" << escapeXml(watch.type) << "\" />";
+      }
+      response << "</watchpoints>";
+    } else if (!is_waiting_) {
+      response << "<error>Watchpoints can only be set while suspended</error>";
+    } else {
+      std::istringstream iss(match[1]);
+      size_t object_id;
+      iss >> std::hex >> object_id;
+      std::string ivar = match[2];
+      queueWork([=](){
+        std::ostringstream out;
+        size_t index = server_->AddWatchPoint(object_id, ivar);
+        if (index != 0) {
+          out << "<watchpointSet n=\"" << index << "\" objectId=\"0x" << std::hex << object_id << std::dec << "\" ivar=\"" << escapeXml(ivar) << "\" />";
+        } else {
+          out << "<error>Cannot watch " << escapeXml(ivar) << "</error>";
+        }
+        sendResponse(out.str());
+      });
+    }
+  }
+
+  // Filter-related commands.
+  static const std::regex include_regex("^(include|exclude)\\s+(.+)$", std::regex_constants::icase);
+  static const std::regex file_filter_regex("^file-filter\\s+(on|off)$", std::regex_constants::icase);
+
+  if (std::regex_match(command, match, include_regex)) {
+    bool include = boost::iequals(match.str(1), "include");
+    std::string path = match[2];
+    boost::replace_all(path, "\\", "/");
+    server_->AddPathFilter(path, include);
+    response << "<file" << (include ? "Included" : "Excluded") << " file=\"" << escapeXml(path) << "\" />";
+  } else if (std::regex_match(command, match, file_filter_regex)) {
+    bool enable = boost::iequals(match.str(1), "on");
+    server_->EnablePathFilter(enable);
+    response << "<fileFilter" << (enable ? "Enabled" : "Disabled") << " />";
+  }
+
+  // Snapshot-related commands.
+  static const std::regex snapshot_breakpoint_regex("^snapshot\\s+(\\d+)\\s+(on|off)$", std::regex_constants::icase);
+  static const std::regex snapshots_regex("^snapshots$", std::regex_constants::icase);
+  static const std::regex snapshot_get_regex("^snapshots?\\s+(\\d+)$", std::regex_constants::icase);
+  static const std::regex snapshots_clear_regex("^snapshots\\s+clear$", std::regex_constants::icase);
+  static const std::regex snapshot_limits_regex("^snapshots\\s+limits((?:\\s+\\w+\\s*=\\s*\\d+)*)$", std::regex_constants::icase);
+
+  if (std::regex_match(command, match, snapshot_breakpoint_regex)) {
+    size_t index = boost::lexical_cast<size_t>(match[1]);
+    bool enable = boost::iequals(match.str(2), "on");
+    if (server_->SnapshotBreakPoint(index, enable)) {
+      response << "<snapshot" << (enable ? "Enabled" : "Disabled") << " bp_id=\"" << index << "\" />";
+    }
+  } else if (std::regex_match(command, match, snapshots_regex)) {
+    response << "<snapshots>";
+    for (const auto &snapshot : server_->GetSnapshots()) {
+      response << "<snapshot id=\"" << snapshot.id << "\" bp_id=\"" << snapshot.bp_index << "\" file=\"" << escapeXml(snapshot.file) << "\" line=\"" << snapshot.line << "\" threadId=\"" << snapshot.thread_id << "\" frames=\"" << snapshot.frames.size() << "\" />";
+    }
+    response << "</snapshots>";
+  } else if (std::regex_match(command, match, snapshot_get_regex)) {
+    Snapshot snapshot;
+    if (server_->GetSnapshot(boost::lexical_cast<size_t>(match[1]), snapshot)) {
+      response << "<snapshot id=\"" << snapshot.id << "\" bp_id=\"" << snapshot.bp_index << "\" file=\"" << escapeXml(snapshot.file) << "\" line=\"" << snapshot.line << "\" threadId=\"" << snapshot.thread_id << "\">";
+      response << "<frames>";
+      for (size_t index = 0; index < snapshot.frames.size(); ++index) {
+        auto &frame = snapshot.frames[index];
+        response << "<frame no=\"" << (index + 1) << "\" file=\"" << escapeXml(frame.file) << "\" line=\"" << frame.line << "\" name=\"" << escapeXml(frame.name) << "\" />";
+      }
+      response << "</frames>";
+      for (size_t index = 0; index < snapshot.locals.size(); ++index) {
+        response << "<variables frame=\"" << (index + 1) << "\">";
+        for (const auto &var : snapshot.locals[index]) {
+          response << "<variable name=\"" << escapeXml(var.name) << "\" kind=\"local\" value=\"" << escapeXml(var.value) << "\" type=\"" << escapeXml(var.type) << "\" hasChildren=\"false\" />";
+        }
+        response << "</variables>";
+      }
+      response << "</snapshot>";
+    } else {
+      response << "<error>No snapshot " << match[1] << "</error>";
+    }
+  } else if (std::regex_match(command, match, snapshots_clear_regex)) {
+    server_->ClearSnapshots();
+    response << "<snapshotsCleared />";
+  } else if (std::regex_match(command, match, snapshot_limits_regex)) {
+    SnapshotLimits limits = server_->GetSnapshotLimits();
+    std::string settings = match[1];
+    static const std::regex setting_regex("(\\w+)\\s*=\\s*(\\d+)");
+    for (std::sregex_iterator iter(settings.begin(), settings.end(), setting_regex), end; iter != end; ++iter) {
+      std::string name = boost::to_lower_copy((*iter)[1].str());
+      size_t value = boost::lexical_cast<size_t>((*iter)[2]);
+      if (name == "frames") limits.max_frames = value;
+      else if (name == "locals") limits.max_local_frames = value;
+      else if (name == "vars") limits.max_variables = value;
+      else if (name == "length") limits.max_string_length = value;
+      else if (name == "count") limits.max_snapshots = value;
+    }
+    server_->SetSnapshotLimits(limits);
+    response << "<snapshotLimits frames=\"" << limits.max_frames << "\" locals=\"" << limits.max_local_frames << "\" vars=\"" << limits.max_variables << "\" length=\"" << limits.max_string_length << "\" count=\"" << limits.max_snapshots << "\" />";
+  }
+
   // Control-related commands.
   static const std::regex continue_regex("^c(?:ont)?$", std::regex_constants::icase);
   static const std::regex finish_regex("^fin(?:ish)?$", std::regex_constants::icase);
   static const std::regex next_regex("^n(?:ext)?$", std::regex_constants::icase);
   static const std::regex pause_regex("^(?:pause(?:\\s+(\\d+))?|i(?:nterrupt)?)$", std::regex_constants::icase);
+  static const std::regex run_to_regex("^run-to\\s+(.+?):(\\d+)$", std::regex_constants::icase);
   static const std::regex quit_regex("^(?:q(?:uit)?|exit|detach)$", std::regex_constants::icase);
   static const std::regex start_regex("^start$", std::regex_constants::icase);
+  static const std::regex step_into_regex("^s(?:tep)?[-\\s]+into\\s+(\\S+)$", std::regex_constants::icase);
+  static const std::regex until_regex("^(step-)?until\\s+(.+)$", std::regex_constants::icase);
   static const std::regex step_regex("^s(?:tep)?$", std::regex_constants::icase);
 
   if (std::regex_match(command, match, continue_regex)) {
@@ -286,12 +573,51 @@ void RDIP::Impl::evaluateCommand(const std::string &command) {
     notifyWait(true);
   } else if (std::regex_match(command, match, pause_regex)) {
     server_->Pause();
+  } else if (std::regex_match(command, match, run_to_regex)) {
+    std::string file = match[1];
+    boost::replace_all(file, "\\", "/");
+    size_t line = boost::lexical_cast<size_t>(match[2]);
+    if (server_->RunTo(file, line)) {
+      notifyWait(true);
+    } else {
+      response << "<error>Cannot run to " << escapeXml(file) << ':' << line << ", the file is not loaded</error>";
+    }
   } else if (std::regex_match(command, match, quit_regex)) {
     notifyWait(true);
     closeConnection();
     doAccept();
   } else if (std::regex_match(command, match, start_regex)) {
     notifyWait(true);
+  } else if (std::regex_match(command, match, step_into_regex)) {
+    std::string method = match[1];
+    if (!is_waiting_) {
+      response << "<error>Cannot step into " << escapeXml(method) << ", execution is not suspended</error>";
+    } else {
+      // The method is looked up in the suspended frame.
+      queueWork([=](){
+        if (server_->StepInto(method)) {
+          stop_waiting_ = true;
+        } else {
+          postResponse("<error>Cannot step into " + escapeXml(method) + ", no such Ruby method</error>");
+        }
+      });
+    }
+  } else if (std::regex_match(command, match, until_regex)) {
+    bool step_into = match[1].matched;
+    std::string expression = match[2];
+    if (!is_waiting_) {
+      response << "<error>Cannot step until " << escapeXml(expression) << ", execution is not suspended</error>";
+    } else {
+      // The predicate is evaluated by the server at each line, the client is
+      // only notified when it is true.
+      queueWork([=](){
+        if (server_->StepUntil(expression, step_into)) {
+          stop_waiting_ = true;
+        } else {
+          postResponse("<error>Cannot step until " + escapeXml(expression) + ", the expression does not compile</error>");
+        }
+      });
+    }
   } else if (std::regex_match(command, match, step_regex)) {
     server_->Step();
     notifyWait(true);
@@ -300,6 +626,9 @@ void RDIP::Impl::evaluateCommand(const std::string &command) {
   // State-related commands.
   static const std::regex frame_regex("^f(?:rame)?\\s+(\\d+)$", std::regex_constants::icase);
   static const std::regex thread_list_regex("^th(?:read)?\\s+l(?:ist)?$", std::regex_constants::icase);
+  static const std::regex thread_current_regex("^th(?:read)?(?:\\s+c(?:ur(?:rent)?)?)?$", std::regex_constants::icase);
+  static const std::regex thread_command_regex("^th(?:read)?\\s+(sw(?:itch)?|stop|resume)\\s+(\\d+)$", std::regex_constants::icase);
+  static const std::regex thread_trace_regex("^th(?:read)?\\s+tr(?:ace)?\\s+(all|main|\\d+(?:\\s+\\d+)*)$", std::regex_constants::icase);
   static const std::regex where_regex("^(?:w(?:here)?|bt|backtrace)$", std::regex_constants::icase);
 
   if (std::regex_match(command, match, frame_regex)) {
@@ -312,7 +641,31 @@ void RDIP::Impl::evaluateCommand(const std::string &command) {
       }
     }
   } else if (std::regex_match(command, match, thread_list_regex)) {
-    response << "<threads><thread id=\"1\" status=\"run\" /></threads>";
+    response << "<threads>";
+    auto threads = server_->GetThreads();
+    std::for_each(threads.begin(), threads.end(), [&](auto &thread){
+      response << threadXml(thread);
+    });
+    response << "</threads>";
+  } else if (std::regex_match(command, match, thread_current_regex)) {
+    auto threads = server_->GetThreads();
+    auto it = std::find_if(threads.begin(), threads.end(), [](auto &thread){ return thread.is_current; });
+    if (it != threads.end()) response << threadXml(*it);
+  } else if (std::regex_match(command, match, thread_command_regex)) {
+    std::string action = boost::to_lower_copy(match.str(1));
+    size_t id = boost::lexical_cast<size_t>(match[2]);
+    bool is_current = server_->IsStopped() && server_->GetCurrentThreadId() == id;
+    if (action == "resume") {
+      // Resuming the suspended thread continues execution.
+      if (server_->ResumeThread(id) && is_current) notifyWait(true);
+    } else if (!is_current && server_->StopThread(id) && action != "stop") {
+      // Switching resumes the suspended thread so that the other one stops.
+      notifyWait(true);
+    }
+  } else if (std::regex_match(command, match, thread_trace_regex)) {
+    std::string threads = match[1];
+    setTracedThreads(server_, threads);
+    response << "<message>Tracing threads: " << escapeXml(threads) << "</message>";
   } else if (std::regex_match(command, match, where_regex)) {
     response << "<frames>";
     const auto &frames = server_->GetStackFrames();
@@ -445,6 +798,25 @@ void RDIP::Impl::handleCheckWorkQueue(const boost::system::error_code &err) {
   }
 }
 
+void RDIP::Impl::doSendLogs() {
+  log_timer_.expires_from_now(boost::posix_time::milliseconds(LogIntervalMs));
+  log_timer_.async_wait(std::bind(&RDIP::Impl::handleSendLogs, this, std::placeholders::_1));
+}
+
+void RDIP::Impl::handleSendLogs(const boost::system::error_code &err) {
+  if (err || !socket_.is_open()) return;
+
+  std::ostringstream response;
+  size_t count = log_buffer_.Drain([&](LogEntry &&entry){
+    response << "<log bp_id=\"" << entry.bp_index << "\" file=\"" << escapeXml(entry.file) << "\" line=\"" << entry.line << "\">" << escapeXml(entry.message) << "</log>";
+  });
+  size_t dropped = log_buffer_.TakeDropped();
+  if (count != 0 || dropped != 0) {
+    sendResponse("<logs dropped=\"" + std::to_string(dropped) + "\">" + response.str() + "</logs>");
+  }
+  doSendLogs();
+}
+
 RDIP::RDIP() : wait_for_client_(false) { }
 RDIP::~RDIP() { }
 
@@ -463,7 +835,15 @@ void RDIP::Initialize(IDebugServer* server, const std::string& str_debugger) {
   static const std::regex wait_regex("\\bwait\\b", std::regex_constants::icase);
   wait_for_client_ = std::regex_search(str_debugger, match, wait_regex);
 
-  impl_ = std::make_shared<Impl>(server_, port);
+  static const std::regex threads_regex("\\bthreads\\s*=\\s*(all|main|\\d+(?:,\\d+)*)", std::regex_constants::icase);
+  if (std::regex_search(str_debugger, match, threads_regex)) {
+    setTracedThreads(server_, match[1]);
+  }
+
+  static const std::regex all_stop_regex("\\ball-stop\\b", std::regex_constants::icase);
+  bool all_stop = std::regex_search(str_debugger, match, all_stop_regex);
+
+  impl_ = std::make_shared<Impl>(server_, port, all_stop);
 }
 
 void RDIP::WaitForContinue() {
@@ -478,7 +858,7 @@ void RDIP::Break(BreakPoint bp) {
   if (!impl_->isClientConnected()) return;
 
   std::ostringstream response;
-  response << "<breakpoint file=\"" << escapeXml(bp.file) << "\" line=\"" << bp.line << "\" threadId=\"1\" />";
+  response << "<breakpoint file=\"" << escapeXml(bp.file) << "\" line=\"" << bp.line << "\" threadId=\"" << server_->GetCurrentThreadId() << "\" />";
   impl_->postResponse(response.str());
   WaitForContinue();
 }
@@ -487,10 +867,33 @@ void RDIP::Break(const std::string& file, size_t line) {
   if (!impl_->isClientConnected()) return;
 
   std::ostringstream response;
-  response << "<suspended file=\"" << escapeXml(file) << "\" line=\"" << line << "\" threadId=\"1\" frames=\"1\" />";
+  response << "<suspended file=\"" << escapeXml(file) << "\" line=\"" << line << "\" threadId=\"" << server_->GetCurrentThreadId() << "\" frames=\"1\" />";
+  impl_->postResponse(response.str());
+  WaitForContinue();
+}
+
+void RDIP::BreakOnException(const std::string& file, size_t line, const std::string& type, const std::string& message) {
+  if (!impl_->isClientConnected()) return;
+
+  std::ostringstream response;
+  response << "<exception file=\"" << escapeXml(file) << "\" line=\"" << line << "\" type=\"" << escapeXml(type) << "\" message=\"" << escapeXml(message) << "\" threadId=\"" << server_->GetCurrentThreadId() << "\" />";
   impl_->postResponse(response.str());
   WaitForContinue();
 }
 
+void RDIP::LogPoint(const BreakPoint& bp, const std::string& message) {
+  if (!impl_->isClientConnected()) return;
+
+  impl_->postLog(bp, message);
+}
+
+void RDIP::ConditionQuarantined(const BreakPoint& bp, const std::string& reason) {
+  if (!impl_->isClientConnected()) return;
+
+  std::ostringstream response;
+  response << "<conditionQuarantined bp_id=\"" << bp.index << "\" condition=\"" << escapeXml(bp.condition) << "\" reason=\"" << escapeXml(reason) << "\" />";
+  impl_->postResponse(response.str());
+}
+
 } // end namespace RubyDebugger
 } // end namespace SketchUp
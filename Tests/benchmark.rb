@@ -0,0 +1,166 @@
+# SketchUp Ruby API Debugger. Copyright 2026 Trimble Inc.
+#
+# Times a hot loop with the debugger in different states. Start SketchUp with
+# the debugger listening for an IDE, without any IDE connected:
+#
+#   SketchUp.exe -rdebug "ide port=1234"
+#
+# and load this file from the Ruby Console:
+#
+#   load 'C:/path/to/Tests/benchmark.rb'
+#
+# The script connects to the debugger itself, like an IDE would. Without the
+# debugger it only times the loop, run it like that once to get the baseline.
+# The port can be set with the RDEBUG_PORT environment variable.
+require 'socket'
+
+module DebuggerBenchmark
+
+  PORT = Integer(ENV['RDEBUG_PORT'] || 1234)
+
+  ITERATIONS = 2_000_000
+
+  # Time given to the debugger's own thread to update the tracepoints after
+  # a command.
+  SETTLE_TIME = 0.2
+
+  # Iterations run before each measurement.
+  WARMUP = 1000
+
+  # Line of the loop body, where the conditional breakpoints are set.
+  LOOP_LINE = __LINE__ + 6
+
+  def self.hot_loop(n)
+    sum = 0
+    i = 0
+    while i < n
+      sum += i
+      i += 1
+    end
+    sum
+  end
+
+  # Number of line events of each iteration of the hot loop.
+  def self.line_events_per_iteration
+    count = 0
+    trace = TracePoint.new(:line) { count += 1 }
+    trace.enable(target: method(:hot_loop)) { hot_loop(1000) }
+    count / 1000.0
+  end
+
+  # Evaluates a condition in the binding of each iteration, like conditions
+  # were evaluated before they were compiled.
+  def self.eval_loop(n, condition)
+    i = 0
+    while i < n
+      eval(condition, binding)
+      i += 1
+    end
+  end
+
+  def self.measure_hits(label, hit_time, attached)
+    puts format('%-44s %9.0f hits/s %7.1f ns/hit', label,
+                ITERATIONS / hit_time, (hit_time - attached) * 1e9 / ITERATIONS)
+  end
+
+  def self.measure(label, iterations = ITERATIONS)
+    hot_loop(WARMUP)
+    start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    hot_loop(iterations)
+    elapsed = Process.clock_gettime(Process::CLOCK_MONOTONIC) - start
+    puts format('%-44s %9.1f ms %8.1f ns/iteration', label, elapsed * 1000,
+                elapsed * 1e9 / iterations)
+    elapsed
+  end
+
+  # A minimal ruby-debug-ide client. Each command used here has a one-line
+  # response.
+  class Client
+
+    def initialize(port)
+      @socket = TCPSocket.new('127.0.0.1', port)
+      sleep(SETTLE_TIME)
+    end
+
+    def command(command)
+      @socket.write("#{command}\n")
+      response = @socket.gets
+      sleep(SETTLE_TIME)
+      response
+    end
+
+    # Returns the index of the breakpoint.
+    def break(location)
+      Integer(command("break #{location}")[/no="(\d+)"/, 1])
+    end
+
+    def delete(index)
+      command("delete #{index}")
+    end
+
+    def hit_count(index)
+      Integer(command('info break')[/<breakpoint n="#{index}"[^>]*hitCount="(\d+)"/, 1])
+    end
+
+    def close
+      @socket.close
+      sleep(SETTLE_TIME)
+    end
+
+  end
+
+  def self.run
+    puts "Ruby #{RUBY_VERSION}, #{ITERATIONS} iterations"
+    detached = measure('Detached')
+    begin
+      client = Client.new(PORT)
+    rescue SystemCallError
+      puts "No debugger listening on port #{PORT}, this is the baseline."
+      return
+    end
+    begin
+      attached = measure('Attached, no breakpoints')
+      puts format('Attached overhead: %.1f%%',
+                  (attached / detached - 1.0) * 100)
+
+      # A breakpoint in a file without known code enables the line hook for
+      # every line, which then takes the path of lines without a breakpoint.
+      events = ITERATIONS * line_events_per_iteration
+      index = client.break('benchmark_no_such_file.rb:1')
+      hooked = measure('Line hook, no breakpoint on the lines')
+      client.delete(index)
+      puts format('Line event without breakpoint: %.1f ns',
+                  (hooked - attached) * 1e9 / events)
+
+      # Conditions which are never true, so that each iteration is a hit
+      # which does not suspend.
+      location = "#{__FILE__}:#{LOOP_LINE}"
+      [
+        ['Native condition', 'i < 0'],
+        ['Compiled condition', 'i + 1 < 0']
+      ].each do |label, condition|
+        index = client.break("#{location} if #{condition}")
+        hit_time = measure("Breakpoint, #{label.downcase}")
+        hits = client.hit_count(index)
+        client.delete(index)
+        if hits != WARMUP + ITERATIONS
+          raise "#{label}: #{hits} hits, expected #{WARMUP + ITERATIONS}"
+        end
+        measure_hits(label, hit_time, attached)
+      end
+      iterations = ITERATIONS / 10
+      start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      eval_loop(iterations, 'i + 1 < 0')
+      elapsed = Process.clock_gettime(Process::CLOCK_MONOTONIC) - start
+      puts format('%-44s %9.0f evals/s %6.1f ns/eval',
+                  'Kernel#eval of the condition, for comparison',
+                  iterations / elapsed, elapsed * 1e9 / iterations)
+    ensure
+      client.close
+    end
+    measure('Detached again')
+  end
+
+end
+
+DebuggerBenchmark.run
@@ -0,0 +1,120 @@
+# SketchUp Ruby API Debugger. Copyright 2026 Trimble Inc.
+#
+# Checks breakpoint conditions which need the scope of the frame they are
+# evaluated in. Start SketchUp with the debugger listening for an IDE, without
+# any IDE connected:
+#
+#   SketchUp.exe -rdebug "ide port=1234"
+#
+# and load this file from the Ruby Console:
+#
+#   load 'C:/path/to/Tests/conditions.rb'
+#
+# The script connects to the debugger itself, like an IDE would. Each
+# condition is false in the right scope and raises in any other, so a
+# condition evaluated in the wrong scope is quarantined. None of them
+# suspends. The port can be set with the RDEBUG_PORT environment variable.
+require 'socket'
+
+module DebuggerConditionTest
+
+  PORT = Integer(ENV['RDEBUG_PORT'] || 1234)
+
+  CALLS = 5
+
+  # Time given to the debugger's own thread to update the tracepoints after
+  # a command.
+  SETTLE_TIME = 0.2
+
+  module Ext
+
+    class Helper
+    end
+
+    class Tool
+
+      # Line of the body of run, where the breakpoint is set.
+      RUN_LINE = __LINE__ + 3
+
+      def run(helper)
+        helper
+      end
+
+    end
+
+  end
+
+  CONDITIONS = [
+    # A constant of the module the code is nested in.
+    '!helper.is_a?(Helper)',
+    # A constant nested in a module the code is nested in.
+    'Tool::RUN_LINE.nil?',
+    # The name of the method of the frame.
+    '__method__.length > 10'
+  ]
+
+  # A minimal ruby-debug-ide client. Each command used here has a one-line
+  # response.
+  class Client
+
+    def initialize(port)
+      @socket = TCPSocket.new('127.0.0.1', port)
+      sleep(SETTLE_TIME)
+    end
+
+    def command(command)
+      @socket.write("#{command}\n")
+      response = @socket.gets
+      sleep(SETTLE_TIME)
+      response
+    end
+
+    # Returns the index of the breakpoint.
+    def break(location)
+      Integer(command("break #{location}")[/no="(\d+)"/, 1])
+    end
+
+    def delete(index)
+      command("delete #{index}")
+    end
+
+    # Returns the attributes of the breakpoint in the breakpoint list.
+    def breakpoint(index)
+      command('info break')[/<breakpoint n="#{index}"[^>]*>/]
+    end
+
+    def close
+      @socket.close
+      sleep(SETTLE_TIME)
+    end
+
+  end
+
+  def self.run
+    client = Client.new(PORT)
+    failures = 0
+    begin
+      tool = Ext::Tool.new
+      CONDITIONS.each do |condition|
+        index = client.break("#{__FILE__}:#{Ext::Tool::RUN_LINE} if " \
+                             "#{condition}")
+        CALLS.times { tool.run(Ext::Helper.new) }
+        breakpoint = client.breakpoint(index)
+        client.delete(index)
+        hits = Integer(breakpoint[/hitCount="(\d+)"/, 1])
+        if hits != CALLS || breakpoint.include?('conditionQuarantined')
+          failures += 1
+          puts "FAIL #{condition}: #{breakpoint}"
+        else
+          puts "PASS #{condition}"
+        end
+      end
+    ensure
+      client.close
+    end
+    puts "#{CONDITIONS.size - failures} of #{CONDITIONS.size} passed"
+  end
+
+end
+
+DebuggerConditionTest.run